@@ -20,27 +20,38 @@ const env = {
     mx : -1,
     my : -1,
     k  : {},
-    ks : [],
 };
 
 canvas.onmousemove =
     e => {
         env.mx = e.offsetX;
         env.my = e.offsetY;
+        pushMouse(e.buttons);
+    }
+;
+
+canvas.onmousedown =
+canvas.onmouseup =
+    e => {
+        pushMouse(e.buttons);
     }
 ;
 
 document.onkeydown =
     e => {
         env.k[e.code] = true;
-        if (!e.repeat)
-            env.ks.push(e.key.toUpperCase());
+        if (!e.repeat) {
+            pushInput(INPUT_KEY_DOWN,e.code);
+            raiseEvent(1);
+        }
     }
 ;
 
 document.onkeyup =
     e => {
         delete env.k[e.code];
+        pushInput(INPUT_KEY_UP,e.code);
+        raiseEvent(1);
     }
 ;
 
@@ -87,6 +98,10 @@ document.onkeyup =
         canvas.style.width = `${env.w*env.s}px`;
         canvas.style.height = `${env.h*env.s}px`;
         ctx.putImageData(env.screen,0,0);
+        if (env.pushed) {
+            env.pushed = false;
+            raiseEvent(4);
+        }
         requestAnimationFrame(update);
     }
     update();
@@ -194,19 +209,18 @@ const Key = {
         [ 'KeyY', 'Y', 89, 0, 24, ],
         [ 'KeyZ', 'Z', 90, 0, 25, ]
     ],
-    code(k) {
-        for (const [key, char, code, keyGroup, keyId] of this.mapping) {
-            if (k == key || k == char) {
-                return code;
-            }
-        }
-    },
-    key(k) {
-        for (const [key, char, code, keyGroup, keyId] of this.mapping) {
-            if (k == key || k == char) {
-                return [keyGroup,keyId];
+    /** @type {Map<string,[number,number]>} key or character -> [character code, bit in the held keys] */
+    lookup: null,
+    /** @returns {[number,number]|undefined} */
+    get(k) {
+        if (!this.lookup) {
+            this.lookup = new Map();
+            for (const [key, char, code, keyGroup, keyId] of this.mapping) {
+                this.lookup.set(key,[code,keyGroup*32+keyId]);
+                this.lookup.set(char,[code,keyGroup*32+keyId]);
             }
         }
+        return this.lookup.get(k);
     },
 };
 
@@ -220,6 +234,209 @@ var instance;
 var memory;
 /** @type {DataView} */
 var memory_view;
+/** @type {number} address of the core's input ring ( see `input_ring` in ge.h ) */
+var input_ring = 0;
+/** @type {[number,number]} last mouse position pushed into the input ring */
+var input_mouse = [0,0];
+
+const INPUT_RING_SIZE = 256;
+const INPUT_KEY_DOWN  = 1;
+const INPUT_KEY_UP    = 2;
+const INPUT_MOUSE     = 3;
+
+/** Pushes an event into the core's input ring, dropping it if the ring is full */
+function pushInput( type, k, buttons=0, dx=0, dy=0 ) {
+    if (!input_ring) return;
+    const head = memory_view.getUint32(input_ring,true);
+    const tail = memory_view.getUint32(input_ring+4,true);
+    if (((head-tail)>>>0) >= INPUT_RING_SIZE) return;
+    const [code,key] = Key.get(k) ?? [0,255];
+    const ev = input_ring+8+(head%INPUT_RING_SIZE)*8;
+    memory[ev+0] = type;
+    memory[ev+1] = key;
+    memory[ev+2] = code;
+    memory[ev+3] = buttons;
+    memory_view.setInt16(ev+4,dx,true);
+    memory_view.setInt16(ev+6,dy,true);
+    memory_view.setUint32(input_ring,(head+1)>>>0,true);
+}
+
+/** Pushes the mouse movement since the last call into the core's input ring */
+function pushMouse( buttons ) {
+    const [x,y] = mousePosI();
+    pushInput(INPUT_MOUSE,null,buttons,x-input_mouse[0],y-input_mouse[1]);
+    input_mouse = [x,y];
+}
+
+const TRACE_BUFFER_SIZE = 1048576;
+const REPLAY_RECORD     = 1;
+
+/** Recording of the session ( enabled with `?record` in the URL, downloaded with `saveTrace()` ) */
+const trace = new URLSearchParams(location.search).has('record') ? { chunks: [], log: 0 } : null;
+
+/** Reserves `size` bytes past the end of the core's memory, for buffers it reads or writes */
+function reserve( size ) {
+    const mem = instance.exports.memory;
+    const ptr = mem.buffer.byteLength;
+    mem.grow(Math.ceil(size/65536));
+    memory = new Uint8Array(mem.buffer);
+    memory_view = new DataView(mem.buffer);
+    return ptr;
+}
+
+/** Starts recording a trace: a snapshot of the machine followed by the log of every host call result */
+function startTrace() {
+    const size = instance.exports.epu_snapshot(0,0,0);
+    const snapshot = reserve(size);
+    instance.exports.epu_snapshot(snapshot,size,0);
+    trace.chunks.push(new Uint32Array([size]),memory.slice(snapshot,snapshot+size));
+    trace.log = reserve(TRACE_BUFFER_SIZE);
+    instance.exports.replay_buffer(trace.log,TRACE_BUFFER_SIZE);
+    instance.exports.replay_start(REPLAY_RECORD);
+}
+
+/** Moves what was recorded out of the core's log buffer */
+function flushTrace() {
+    trace.chunks.push(memory.slice(trace.log,trace.log+instance.exports.replay_length()));
+    instance.exports.replay_buffer(trace.log,TRACE_BUFFER_SIZE);
+}
+
+/** Downloads the recorded trace ( replay it with `epu-native -P` ) */
+function saveTrace() {
+    if (!trace) return console.log('open the page with `?record` to record a trace');
+    flushTrace();
+    const a = document.createElement('a');
+    a.href = URL.createObjectURL(new Blob(trace.chunks));
+    a.download = 'epu.trace';
+    a.click();
+}
+
+const STREAM_MAGIC    = 0x56555045;
+const STREAM_VERSION  = 1;
+const STREAM_TILE_RAW = 0;
+const STREAM_TILE_RLE = 1;
+
+/** Video stream of `epu-native -v` to watch instead of running the core ( `?stream=<url>` in the URL ) */
+const stream_url = new URLSearchParams(location.search).get('stream');
+
+/**
+ * Paints the tiles of a frame of a video stream on the screen ( see src/epu-c/stream.h )
+ * @param {DataView} view the tiles of the frame
+ * @param {number} tiles amount of tiles
+ * @param {number} tile width and height of the tiles
+ */
+function decodeFrame( view, tiles, tile ) {
+    const [w,h] = screenSize();
+    const data = env.screen.data;
+    const columns = Math.ceil(w/tile);
+    let o = 0;
+    for (let t = 0; t < tiles; t++) {
+        const index = view.getUint16(o,true);
+        const mode = view.getUint8(o+2);
+        const colors = view.getUint8(o+3)+1;
+        o += 4;
+        const x0 = index%columns*tile;
+        const y0 = Math.floor(index/columns)*tile;
+        const tw = Math.min(tile,w-x0);
+        const th = Math.min(tile,h-y0);
+        const palette = o;
+        if (mode == STREAM_TILE_RLE) o += colors*3;
+        let run = 0;
+        let color = 0;
+        for (let p = 0; p < tw*th; p++) {
+            if (mode == STREAM_TILE_RAW) {
+                color = o;
+                o += 3;
+            } else if (!run--) {
+                run = view.getUint8(o);
+                color = palette+view.getUint8(o+1)*3;
+                o += 2;
+            }
+            const i = ((y0+Math.floor(p/tw))*w+x0+p%tw)*4;
+            data[i+0] = view.getUint8(color+0);
+            data[i+1] = view.getUint8(color+1);
+            data[i+2] = view.getUint8(color+2);
+            data[i+3] = 255;
+        }
+    }
+}
+
+/** Plays a video stream as it downloads, a frame per animation frame */
+async function playStream( url ) {
+    const reader = (await fetch(url)).body.getReader();
+    let buffer = new Uint8Array(0);
+    let tile = 0;
+    for (;;) {
+        const { done, value } = await reader.read();
+        if (done) break;
+        const merged = new Uint8Array(buffer.length+value.length);
+        merged.set(buffer);
+        merged.set(value,buffer.length);
+        buffer = merged;
+        const view = new DataView(buffer.buffer);
+        let o = 0;
+        if (!tile) {
+            if (buffer.length < 16) continue;
+            if (view.getUint32(0,true) != STREAM_MAGIC || view.getUint32(4,true) != STREAM_VERSION) throw new Error(`\`${url}\` is not a video stream`);
+            screenSize(view.getUint16(8,true),view.getUint16(10,true));
+            tile = view.getUint16(12,true);
+            o = 16;
+        }
+        while (o+12 <= buffer.length && o+12+view.getUint32(o,true) <= buffer.length) {
+            decodeFrame(new DataView(buffer.buffer,o+12,view.getUint32(o,true)),view.getUint16(o+8,true),tile);
+            o += 12+view.getUint32(o,true);
+            await new Promise(requestAnimationFrame);
+        }
+        buffer = buffer.slice(o);
+    }
+}
+
+/** @type {?() => void} resumes the core after it blocked on events */
+var resume = null;
+
+/** Resumes the core if it was waiting on events */
+function resumeCore() {
+    if (resume) {
+        const r = resume;
+        resume = null;
+        r();
+    }
+}
+
+/** Raises events on the core ( 1: key, 4: video acknowledgement ) and resumes it if it was waiting on them */
+function raiseEvent( events ) {
+    if (!instance) return;
+    instance.exports.epu_event(events);
+    resumeCore();
+}
+
+const BUS_BATCH     = 0xFFFFFFFF;
+const BUS_RING_SIZE = 32;
+const BUS_PENDING   = -0x80000000;
+
+/** @type {number} address of the core's peripheral bus batch ( see `bus_batch` in bus.h ) */
+var bus_batch = 0;
+/** @type {string} console output of the guest, logged a line at a time */
+var bus_console = '';
+
+/** Peripherals of the bus by address ( see bus.h ), they return the result of a command or a promise of it */
+const peripherals = {
+    1: (a) => { // Console
+        if (a == 10) {
+            console.log(bus_console);
+            bus_console = '';
+        }
+        else bus_console += String.fromCharCode(a&255);
+        return 0;
+    },
+    2: (a) => new Promise( r=>setTimeout(()=>r(0),a) ), // Timer
+};
+
+/** Completes a command of the bus that was left pending, resuming the core if it was waiting on it */
+function completeBus( tag, result ) {
+    instance.exports.bus_complete(tag,result);
+    resumeCore();
+}
 
 const WasmLib = {
     'env': {
@@ -236,7 +453,7 @@ const WasmLib = {
             for (let xx = 0; xx < w && xx+x < ww; xx++) {
                 for (let yy = 0; yy < h && yy+y < hh; yy++) {
                     let i = (x+xx+(y+yy)*ww)*3+data;
-                    let j = (xx+yy*ww)*4;
+                    let j = (x+xx+(y+yy)*ww)*4;
                     env.screen.data[j+0] = memory[i+0];
                     env.screen.data[j+1] = memory[i+1];
                     env.screen.data[j+2] = memory[i+2];
@@ -246,7 +463,7 @@ const WasmLib = {
         },
 
         ge_screen_push: () => {
-            /* not implemented yet :p */
+            env.pushed = true;
         },
 
         epu_load_floppy: (id,data_ptr,size_ptr) => {
@@ -257,32 +474,22 @@ const WasmLib = {
             return 1;
         },
 
-        ge_keys_last: () => {
-            const [c] = env.ks.splice(0,1);
-            if (typeof c == 'string') {
-                const code = Key.code(c);
-                return code ? code : 0;
+        epu_call_peripheral: (address,count) => {
+            if (address>>>0 != BUS_BATCH) return 0;
+            // Runs the whole batch of a doorbell, commands that can't complete right away post their result once they do
+            for (let i = 0; i < count; i++) {
+                const cmd = bus_batch+4+i*24;
+                const [addr,a,b,c,d,tag] = [0,4,8,12,16,20].map( o=>memory_view.getUint32(cmd+o,true) );
+                let result = peripherals[addr] ? peripherals[addr](a,b,c,d) : -1;
+                if (result instanceof Promise) {
+                    result.then( r=>completeBus(tag,r|0) );
+                    result = BUS_PENDING;
+                }
+                memory_view.setInt32(bus_batch+4+BUS_RING_SIZE*24+i*4,result,true);
             }
             return 0;
         },
 
-        ge_keys_pressed: (ptr) => {
-            let a = 0;
-            let b = 0;
-            for (const k in env.k) if (env.k[k]) {
-                const v = Key.key(k);
-                if (!v) continue;
-                const [id,bit] = v;
-                const u = 1 << bit;
-                if (id == 0)
-                    a |= u;
-                if (id == 1)
-                    b |= u;
-            }
-            memory_view.setInt32(ptr,a,true);
-            memory_view.setInt32(ptr+4,b,true);
-        },
-
         ge_random: () => {
             return Math.random()*Number.MAX_SAFE_INTEGER;
         },
@@ -291,6 +498,14 @@ const WasmLib = {
             memory.fill(v,ptr,ptr+c);
         },
 
+        memcpy: (dst,src,c) => {
+            memory.copyWithin(dst,src,src+c);
+        },
+
+        memmove: (dst,src,c) => {
+            memory.copyWithin(dst,src,src+c);
+        },
+
         debug: (...args) => {
             console.debug(...args);
         }
@@ -303,7 +518,11 @@ const floppies = new Map();
 ;(async()=>{
 
     try {
-        const boot_floppy = await fetch('boot.img');
+        if (stream_url) return await playStream(stream_url);
+
+        // The compressed image ( see tasks/packdisk.py ) when there is one, the raw one otherwise
+        let boot_floppy = await fetch('boot.epud');
+        if (!boot_floppy.ok) boot_floppy = await fetch('boot.img');
         if (boot_floppy.ok) {
             floppies.set(0,new Uint8Array(await boot_floppy.arrayBuffer()));
         }
@@ -314,6 +533,9 @@ const floppies = new Map();
         memory_view = new DataView(instance.exports.memory.buffer);
         
         let init = instance.exports.init();
+        input_ring = instance.exports.input_ring_ptr();
+        bus_batch = instance.exports.bus_batch_ptr();
+        if (trace && !init) startTrace();
         
         if ( !init ) {
             /*while (true) {
@@ -324,13 +546,28 @@ const floppies = new Map();
                 }
                 await new Promise( r=>setTimeout(r,1) );
             }*/
-           const i = setInterval(()=>{
-            let status = instance.exports.loop(1024*10);
+            // Runs the core in slices and waits whenever the emulated clock gets ahead of real time
+            let start = performance.now();
+            const step = () => {
+                let status = instance.exports.loop(1024*10);
+                if (trace) flushTrace();
                 if (status) {
                     console.log('execution finished with status',status);
-                    clearInterval(i);
+                    return;
+                }
+                if (instance.exports.clock_idle()>>>0 == 0xFFFFFFFF) {
+                    // Every context waits on an event, `raiseEvent` picks things back up ( the emulated clock stood still meanwhile )
+                    const blocked = performance.now();
+                    resume = () => {
+                        start += performance.now()-blocked;
+                        step();
+                    };
+                    return;
                 }
-           },0);
+                const ahead = instance.exports.clock_seconds()*1000 - (performance.now()-start);
+                setTimeout(step,Math.max(0,ahead));
+            };
+            step();
         } else {
             console.log('`init` failed with status',init);
         }
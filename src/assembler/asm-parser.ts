@@ -124,6 +124,39 @@ export class ParserNode {
     feed(parser: Parser, token: Token): void { throw Error('This should not have happened.'); }
 }
 
+const OPCODES: Set<string> = new Set([
+    'mov',
+    'cmp',
+    'int',
+    'cal',
+    'ret',
+    
+    'add',
+    'sub',
+    'mul',
+    'div',
+    'and',
+    'or',
+    'xor',
+    'shl',
+    'shr',
+    'mod',
+
+    'jmp',
+    'jeq', 'jne',
+    'jgt', 'jge',
+    'jlt', 'jle',
+
+    'xadd', 'xchg', 'cas',
+    'fence',
+
+    'push', 'pop',
+
+    'section',
+    'db', 'dw', 'dd',
+    'resb',
+]);
+
 export class ProgramNode extends ParserNode {
     children: (InstructionNode|LabelNode)[];
 
@@ -134,30 +167,7 @@ export class ProgramNode extends ParserNode {
 
     feed(parser: Parser, token: Token): void {
         if (token.kind == 'identifier') {
-            const ops = Object.fromEntries([
-                'mov',
-                'cmp',
-                'int',
-                'cal',
-                'ret',
-                
-                'add',
-                'sub',
-                'mul',
-                'div',
-                'and',
-                'or',
-                'xor',
-                'shl',
-                'shr',
-                'mod',
-
-                'jmp',
-                'jeq', 'jne',
-                'jgt', 'jge',
-                'jlt', 'jnl',
-            ].map(o=>[o,null]));
-            if (token.val in ops) {
+            if (OPCODES.has(token.val)) {
                 const node = new InstructionNode(token);
                 this.children.push(node);
                 parser.stack.push(node);
@@ -362,12 +372,22 @@ export function tokenize( source: Source ) : Token[] {
     for (let i = 0; i < source.body.length; i++) {
         const chr: string = source.body[i];
 
-        if (t[0] == '"') {
-            if (chr == '"') {
-                pushtoken(chr);
-            } else {
-                t += chr;
+        if (chr == ';' && t[0] != '"') { // Comments are skipped up to the end of the line
+            col--;
+            pushtoken();
+            col++;
+            while (i+1 < source.body.length && source.body[i+1] != '\n') {
+                i++;
+                col++;
             }
+            col++;
+            continue;
+        }
+
+        if (t[0] == '"') {
+            t += chr;
+            if (chr == '"') // Closes the string
+                pushtoken();
         } else {
             if (SYMBOL_REGEX.test(chr)) {
                 col--;
@@ -399,13 +419,5 @@ export function tokenize( source: Source ) : Token[] {
 
     tokens.push(new Token(col,row,'',source,'eof'));
 
-    for (let i = 0; i < tokens.length; i++) {
-        const tk = tokens[i];
-        if (tk.val == ';') {
-            while (tokens[i].kind != 'eof' && tokens[i].kind != 'newline')
-                tokens.splice(i,1);
-        }
-    }
-
     return tokens;
 }
\ No newline at end of file
@@ -31,6 +31,12 @@ type SzB = 8 | 16 | 32 | 64;
 
 type Endian = 'le' | 'be';
 
+/** Sections of an executable ( see src/epu-c/exec.h ), the bss is reserved after the data */
+type Section = 'code' | 'data' | 'ropd' | 'bss';
+
+/** `EXEC_SECTION_*` of each section */
+const SECTION_IDS: Record<Section,number> = { code: 0, data: 1, bss: 1, ropd: 2 };
+
 type Val = {
     loc?: {
         addr: number,
@@ -41,23 +47,31 @@ type Val = {
     prebuild?: (v: Val) => void,
     val?: number,
     kind: Mnem,
+    /** Name of the label the value is the address of */
+    label?: string,
+    /** Whether the value is encoded relative to the instruction ( it doesn't need relocating ) */
+    rel?: boolean,
+    /** Bytes of a string literal */
+    bytes?: Buffer,
 };
 
 class Buff {
     private ptr : number;
+    private size : number;
     private buff : Buffer;
     private vals : Val[];
     public endian : Endian;
 
-    public constructor ( endian: Endian = 'le' ) {
-        this.buff = Buffer.alloc(0);
+    public constructor ( endian: Endian = 'le', capacity: number = 256 ) {
+        this.buff = Buffer.alloc(capacity);
         this.ptr = 0;
+        this.size = 0;
         this.endian = endian;
         this.vals = [];
     }
 
     public getSize() : number {
-        return this.buff.length;
+        return this.size;
     }
 
     public build() : Buffer {
@@ -69,26 +83,26 @@ class Buff {
                 val.build(val);
             }
         }
-        const buff = Buffer.from(this.buff);
+        const buff = Buffer.from(this.buff.subarray(0,this.size));
         return buff;
     }
 
     /**
      * Ensures n bytes are allocated at the given address, extending the internal buffer otherwise
-     * (the new data may contain anything )
+     * (the capacity is doubled when growing, so that pushing stays amortized constant time)
      */
     private _res( idx: number, len: number ) { // REServe
-        if (idx + len > this.buff.length) {
-            this.buff = Buffer.concat([this.buff,Buffer.allocUnsafe(idx+len-this.buff.length)]);
+        const end = idx + len;
+        if (end > this.buff.length) {
+            let capacity = this.buff.length || 1;
+            while (capacity < end)
+                capacity *= 2;
+            const buff = Buffer.alloc(capacity);
+            this.buff.copy(buff,0,0,this.size);
+            this.buff = buff;
         }
-    }
-
-    /**
-     * Ensures n bytes are allocated at the given address, extending the internal buffer otherwise
-     */
-    private _ress( idx: number, len: number ) { // REServe Safe
-        if (idx + len > this.buff.length) {
-            this.buff = Buffer.concat([this.buff,Buffer.alloc(idx+len-this.buff.length)]);
+        if (end > this.size) {
+            this.size = end;
         }
     }
 
@@ -101,7 +115,10 @@ class Buff {
 
     public pushUSized( sz: SzA, v: number ) : this {
         this._res(this.ptr,1<<sz);
-        this.buff[`writeUInt${this.endian.toUpperCase()}`](v,this.ptr,1<<sz);
+        if (this.endian == 'le')
+            this.buff.writeUIntLE(v,this.ptr,1<<sz);
+        else
+            this.buff.writeUIntBE(v,this.ptr,1<<sz);
         this.ptr += 1<<sz;
         return this;
     }
@@ -138,13 +155,19 @@ class Buff {
 
     public setUSized( addr: number, sz: SzA, v: number ) : this {
         this._res(addr,1<<sz);
-        this.buff[`writeUInt${this.endian.toUpperCase()}`](v,addr,1<<sz);
+        if (this.endian == 'le')
+            this.buff.writeUIntLE(v,addr,1<<sz);
+        else
+            this.buff.writeUIntBE(v,addr,1<<sz);
         return this;
     }
 
     public setSized( addr: number, sz: SzA, v: number ) : this {
         this._res(addr,1<<sz);
-        this.buff[`writeInt${this.endian.toUpperCase()}`](v,addr,1<<sz);
+        if (this.endian == 'le')
+            this.buff.writeIntLE(v,addr,1<<sz);
+        else
+            this.buff.writeIntBE(v,addr,1<<sz);
         return this;
     }
 
@@ -174,7 +197,16 @@ class Buff {
 
 interface Op {
     mnemonics : Mnem[][],
-    build: ( buffer: Buff, size: SzA, args: Val[] ) => void,
+    /** `imd` is the size picked for the immediate operand of relaxed instructions */
+    build: ( buffer: Buff, size: SzA, args: Val[], imd?: SzA ) => void,
+    /** Whether the immediate operand of the instruction can be relaxed to a smaller size */
+    relaxable?: ( args: Val[] ) => boolean,
+    /** The value the immediate operand has to hold once the instruction is placed at `base` */
+    relax?: ( args: Val[], base: number ) => number,
+    /** Whether the relaxed immediate operand is relative to the instruction */
+    relative?: boolean,
+    /** Whether it only emits data, and can be used outside of the code section */
+    data?: boolean,
 }
 
 const instructions : { [op: string]: {[k:string|number|symbol]:any}&Op } = {
@@ -189,13 +221,34 @@ const instructions : { [op: string]: {[k:string|number|symbol]:any}&Op } = {
             [ Mnem.imdp, Mnem.reg  ],
             [ Mnem.imdp, Mnem.imd  ]
         ],
-        build ( buff, size, args ) {
+        relaxable ( args ) {
+            return args[1].kind == Mnem.imd;
+        },
+        relax ( args ) {
+            return args[1].val ?? 0;
+        },
+        build ( buff, size, args, imd ) {
+            let [a,b] = args;
+            if (a.kind == Mnem.reg && b.kind == Mnem.reg && (a.val == Reg.sp || b.val == Reg.sp)) { // Only PUSH / POP reach the stack pointer
+                buff
+                    .pushU8(a.val == Reg.sp ? 0x0A : 0x0B)
+                    .pushU8(16)
+                    .pushU8(((a.val == Reg.sp ? b.val : a.val) ?? 0)&15)
+                    .pushU8(0)
+                ;
+                return;
+            }
+            // A register is fully overwritten by an immediate, so its size can just shrink,
+            // memory keeps its size and gets a short immediate instead
+            if (imd != undefined && a.kind == Mnem.reg)
+                size = imd;
+            const bsize = imd ?? size;
+            const short = bsize != size;
             buff
                 .pushU8(0x02)
-                .pushU8(size&15)
+                .pushU8((size&15)|(short?32|(bsize<<6):0))
                 .pushU8((args[0].kind)|((args[1].kind)<<4))
             ;
-            let [a,b] = args;
             if (b.kind == Mnem.reg || b.kind == Mnem.regp) {
                 buff.pushVal(b,1);
                 b.build = () => { if (!b.loc || b.val==undefined || a.val==undefined) return;
@@ -209,9 +262,9 @@ const instructions : { [op: string]: {[k:string|number|symbol]:any}&Op } = {
                 };
             }
             if (b.kind == Mnem.imd) {
-                buff.pushVal(b,(1<<size));
+                buff.pushVal(b,(1<<bsize));
                 b.build = () => { if (!b.loc || b.val==undefined) return;
-                    buff.setUSized(b.loc.addr,size,b.val);
+                    buff.setUSized(b.loc.addr,bsize,b.val);
                 };
             }
 
@@ -265,20 +318,29 @@ const instructions : { [op: string]: {[k:string|number|symbol]:any}&Op } = {
                         [ Mnem.reg, Mnem.reg ],
                         [ Mnem.reg, Mnem.imd ],
                     ],
-                    build ( buff, size, args ) {
+                    relaxable ( args ) {
+                        return args[1].kind == Mnem.imd;
+                    },
+                    relax ( args ) {
+                        return args[1].val ?? 0;
+                    },
+                    build ( buff, size, args, imd ) {
                         const [a,b] = args;
+                        // The operation keeps its size ( the result is masked with it ), only the immediate shrinks
+                        const bsize = imd ?? size;
+                        const short = bsize != size;
                         buff
                             .pushU8(0x01)
-                            .pushU8(size|(+(b.kind==Mnem.imd)<<4))
+                            .pushU8(size|(+(b.kind==Mnem.imd)<<4)|(short?32|(bsize<<6):0))
                             .pushU8(id)
                             .pushVal(a,1)
                         ;
                         if (b.kind == Mnem.imd)
-                            buff.pushVal(b,(1<<size));
-                        a.build = () => { if (!a.loc || !b.loc || a.val == undefined || b.val == undefined) return;
-                            if (b.kind == Mnem.imd) {
+                            buff.pushVal(b,(1<<bsize));
+                        a.build = () => { if (!a.loc || a.val == undefined || b.val == undefined) return;
+                            if (b.loc) {
                                 buff.setU8(a.loc.addr,a.val);
-                                buff.setUSized(b.loc.addr,size,b.val);
+                                buff.setUSized(b.loc.addr,bsize,b.val);
                             } else
                                 buff.setU8(a.loc.addr,a.val|(b.val<<4));
                         }
@@ -362,9 +424,18 @@ const instructions : { [op: string]: {[k:string|number|symbol]:any}&Op } = {
                     [ Mnem.reg ],
                     [ Mnem.regp ],
                 ],
-                build ( buff, size, args ) {
+                relaxable ( args ) {
+                    return args[0].kind == Mnem.imd;
+                },
+                relax ( args, base ) {
+                    return (args[0].val ?? 0) - base;
+                },
+                relative: true,
+                build ( buff, size, args, imd ) {
                     const [src] = args;
                     const base = buff.getSize();
+                    size = imd ?? size;
+                    src.rel = true;
                     buff
                         .pushU8(0x04)
                         .pushU8(0)
@@ -389,8 +460,18 @@ const instructions : { [op: string]: {[k:string|number|symbol]:any}&Op } = {
             [ Mnem.reg ],
             [ Mnem.regp ],
         ],
-        build ( buff, size, args ) {
+        relaxable ( args ) {
+            return args[0].kind == Mnem.imd;
+        },
+        relax ( args, base ) {
+            return (args[0].val ?? 0) - base;
+        },
+        relative: true,
+        build ( buff, size, args, imd ) {
             const [src] = args;
+            const base = buff.getSize();
+            size = imd ?? size;
+            src.rel = imd != undefined;
             buff
                 .pushU8(0x07)
                 .pushU8(size)
@@ -398,7 +479,17 @@ const instructions : { [op: string]: {[k:string|number|symbol]:any}&Op } = {
                 .pushVal(src,1<<size)
             ;
             src.build = () => { if (!src.loc || src.val == undefined) return;
-                const addr = (src.val&0xFFFFFF) | 0xFF000000; // TODO: Support for userspace
+                if (imd != undefined) { // Relative call
+                    const diff = src.val - base;
+                    buff.setUSized(src.loc.addr,size,Math.abs(diff));
+                    buff.setU8(src.loc.addr-2,size|16|(diff<0?32:0));
+                    return;
+                }
+                if (executable) { // Relocated to where the code is loaded
+                    buff.setUSized(src.loc.addr,size,src.val);
+                    return;
+                }
+                const addr = (src.val&0xFFFFFF) | 0xFF000000;
                 buff.setSized(src.loc.addr,size,addr);
             }
         }
@@ -411,6 +502,98 @@ const instructions : { [op: string]: {[k:string|number|symbol]:any}&Op } = {
                 .pushU8(0)
             ;
         }
+    },
+    ...Object.fromEntries(([
+        ['xadd', 0x00],
+        ['xchg', 0x01],
+        ['cas',  0x02], // Expects the value in ra, which receives the old one
+    ] as [string,number][]).map(
+        ([op,id]) => {
+            return [
+                op,
+                {
+                    mnemonics : [
+                        [ Mnem.regp, Mnem.reg ],
+                    ],
+                    build ( buff, size, args ) {
+                        const [dst,src] = args;
+                        buff
+                            .pushU8(0x09)
+                            .pushU8(size)
+                            .pushU8(id)
+                            .pushU8((dst.val??0)&15 | ((src.val??0)&15)<<4)
+                        ;
+                    }
+                }
+            ];
+        }
+    )),
+    ...Object.fromEntries(([
+        ['push', 0x0A],
+        ['pop',  0x0B], // Takes the same registers as the matching push
+    ] as [string,number][]).map(
+        ([op,id]) => {
+            return [
+                op,
+                {
+                    mnemonics : [
+                        [ Mnem.reg ], // Any amount of them
+                    ],
+                    build ( buff, size, args ) {
+                        const mask = args.reduce((m,r) => m | 1<<((r.val??0)&15), 0);
+                        buff
+                            .pushU8(id)
+                            .pushU8(size)
+                            .pushU16(mask)
+                        ;
+                    }
+                }
+            ];
+        }
+    )),
+    'fence' : {
+        mnemonics : [],
+        build ( buff, size, args ) {
+            buff
+                .pushU8(0x09)
+                .pushU8(0)
+                .pushU8(0x03)
+                .pushU8(0)
+            ;
+        }
+    },
+    ...Object.fromEntries(([
+        ['db', 0],
+        ['dw', 1],
+        ['dd', 2],
+    ] as [string,SzA][]).map(
+        ([name,sz]) => {
+            return [name,{
+                mnemonics : [],
+                data: true,
+                build ( buff, size, args ) {
+                    for (const v of args) {
+                        if (v.bytes) { // Strings are stored as they are
+                            buff.pushBuffer(v.bytes);
+                            continue;
+                        }
+                        buff.pushVal(v,1<<sz);
+                        v.build = () => { if (!v.loc || v.val == undefined) return;
+                            buff.setUSized(v.loc.addr,sz,v.val);
+                        };
+                    }
+                }
+            }];
+        }
+    )),
+    'resb' : {
+        mnemonics : [
+            [ Mnem.imd ]
+        ],
+        data: true,
+        build ( buff, size, args ) {
+            buff.pushBuffer(Buffer.alloc(args[0].val ?? 0));
+        }
     }
 };
 
@@ -418,14 +601,24 @@ type Instruction =
     { type : 'opcode',
         name : Token,
         args : Val[],
-        size : SzA
+        size : SzA,
+        /** Size of the immediate operand, for instructions without an explicit size that can be relaxed */
+        imd? : SzA,
+        /** Address of the instruction in the last layout */
+        base? : number,
     } | { type : 'label',
         name : string,
+    } | { type : 'section',
+        name : Token,
+        section : Section,
     }
 ;
 
 const [,,asmpath,outpath] = process.argv;
 
+/** Executables ( see src/epu-c/exec.h ) have sections and relocations, other outputs are the raw code of the boot program */
+const executable = !!outpath?.endsWith('.epx');
+
 if (!asmpath) {
     console.error(
         `\x1b[31;1mERROR\x1b[39;22m: Missing assembly source argument`
@@ -466,7 +659,21 @@ const prog: Instruction[] = [];
 const ast = parse(Source.fromFile(asmpath));
 // console.dir(ast,{depth:50,customInspect:true});
 
-const refs: {name:string,obj:Val}[] = [];
+/** Values waiting for the address of a label, by label name */
+const refs: Map<string,Val[]> = new Map();
+
+function addRef(name: string, obj: Val) {
+    const list = refs.get(name);
+    if (list)
+        list.push(obj);
+    else
+        refs.set(name,[obj]);
+}
+
+function resolveRefs(name: string, val: number) {
+    for (const obj of refs.get(name) ?? [])
+        obj.val = val;
+}
 
 function resolve(arg: ArgumentNode): Val {
     const argv = arg.value;
@@ -492,9 +699,10 @@ function resolve(arg: ArgumentNode): Val {
                 else
                     value.kind = argv.ptr ? Mnem.regp : Mnem.reg;
                 v.val = value.val;
+                v.label = value.label;
             }
         };
-        refs.push({name,obj});
+        addRef(name,obj);
         return obj;
     }
     else if (argv.value.type == 'number') {
@@ -503,12 +711,30 @@ function resolve(arg: ArgumentNode): Val {
             val: argv.value.value
         };
     }
+    else if (argv.value.type == 'string' && !argv.ptr) {
+        return {
+            kind: Mnem.imd,
+            bytes: Buffer.from(argv.value.value,'utf-8'),
+        };
+    }
     else {
         throw Error(`Unsupported argument type \`${argv.value.type}\``);
     }
 }
 
 function explore(node: ParserNode): Instruction | undefined {
+    if (node instanceof InstructionNode && node.name.val == 'section') {
+        const arg = node.args[0]?.value?.value;
+        if (!executable)
+            throw evalError(node.name.loc,'Sections are only supported in executables','Name the output `*.epx`');
+        if (node.args.length != 1 || arg?.type != 'identifier' || !(arg.token.val in SECTION_IDS))
+            throw evalError(node.name.loc,'Expected `code`, `data`, `ropd` or `bss`');
+        return {
+            type: 'section',
+            name: node.name,
+            section: arg.token.val as Section,
+        };
+    }
     if (node instanceof InstructionNode) {
         const inst: Instruction = {
             type: 'opcode',
@@ -518,6 +744,18 @@ function explore(node: ParserNode): Instruction | undefined {
         };
         for (const arg of node.args)
             inst.args.push(resolve(arg));
+        if (inst.args.some(a => a.bytes) && !instructions[node.name.val]?.data)
+            throw evalError(node.name.loc,'Strings can only be used as data');
+        if ((node.name.val == 'push' || node.name.val == 'pop') && inst.args.some(a => a.kind != Mnem.reg || (a.val ?? 16) > 15))
+            throw evalError(node.name.loc,'Expected general registers');
+        const spMove = node.name.val == 'mov' && inst.args.length == 2 && inst.args.every(a => a.kind == Mnem.reg)
+            && inst.args.filter(a => a.val == Reg.sp).length == 1 && inst.args.every(a => a.val == Reg.sp || (a.val ?? 16) <= 15);
+        if (!spMove && inst.args.some(a => (a.kind == Mnem.reg || a.kind == Mnem.regp) && (a.val ?? 0) > 15)) // The core has no encoding for them
+            throw evalError(node.name.loc,'`sp` can only be moved to or from a general register, `pc` can\'t be used','Use `mov sp, ra` or `mov ra, sp`');
+        if (node.name.val == 'resb' && (node.args.length != 1 || node.args[0].value?.value.type != 'number'))
+            throw evalError(node.name.loc,'Expected the amount of bytes to reserve');
+        if (node.s == undefined && instructions[node.name.val]?.relaxable?.(inst.args))
+            inst.imd = 0;
         return inst;
     }
     else if (node instanceof LabelNode) {
@@ -540,7 +778,8 @@ for (const node of ast.children) {
 
 for (const inst of prog) if (inst.type == 'label') {
     vars[inst.name] = {
-        kind: Mnem.imd
+        kind: Mnem.imd,
+        label: inst.name,
     };
 }
 
@@ -551,29 +790,118 @@ for (const inst of prog) if (inst.type == 'opcode') {
             delete arg.prebuild;
         }
     }
+    // The addresses of labels are only known once the executable is loaded, they keep 32 bits for their relocation
+    if (executable && inst.imd != undefined && !instructions[inst.name.val]?.relative && inst.args.some(a => a.label != undefined))
+        delete inst.imd;
 }
 
 // console.dir(prog,{depth:10});
 
-const buff = new Buff();
+/** Section of each label, from the last layout */
+const labelSections: Map<string,Section> = new Map();
+
+/**
+ * Lays out the whole program with the current instruction sizes ( the values are only encoded by `Buff.build` ),
+ * labels are valued with their offset in their section ( the bss follows the data )
+ */
+function layout(): Record<Section,Buff> {
+    const buffs: Record<Section,Buff> = { code: new Buff(), data: new Buff(), ropd: new Buff(), bss: new Buff() };
+    const bss: string[] = [];
+    let section: Section = 'code';
+
+    for (const inst of prog) {
+        const buff = buffs[section];
+        if (inst.type == 'opcode') {
+            const i = instructions[inst.name.val];
+            if (!i)
+                throw evalError(inst.name.loc,'Unimplemented instruction');
+            if (section != 'code' && !i.data)
+                throw evalError(inst.name.loc,'Instructions have to be in the code section');
+            if (section == 'bss' && inst.name.val != 'resb')
+                throw evalError(inst.name.loc,'The bss section can only reserve bytes');
+            inst.base = buff.getSize();
+            i.build(buff,inst.size,inst.args,inst.imd);
+        }
+        else if (inst.type == 'label') {
+            labelSections.set(inst.name,section);
+            if (section == 'bss')
+                bss.push(inst.name);
+            vars[inst.name].val = buff.getSize();
+            resolveRefs(inst.name,buff.getSize());
+        }
+        else if (inst.type == 'section') {
+            section = inst.section;
+        }
+    }
 
-for (const inst of prog) {
-    if (inst.type == 'opcode') {
-        const i = instructions[inst.name.val];
-        if (!i)
-            throw evalError(inst.name.loc,'Unimplemented instruction');
-        i.build(buff,inst.size,inst.args);
+    for (const name of bss) {
+        const val = (vars[name].val ?? 0) + buffs.data.getSize();
+        vars[name].val = val;
+        resolveRefs(name,val);
     }
-    else if (inst.type == 'label') {
-        vars[inst.name].val = buff.getSize();
-        for (const ref of refs) if (ref.name == inst.name) { // TODO: Extract in function
-            ref.obj.val = vars[inst.name].val;
+
+    return buffs;
+}
+
+/** Returns the smallest size that can hold a value */
+function sizeOf(v: number): SzA {
+    v = Math.abs(v);
+    return v <= 0xFF ? 0 : v <= 0xFFFF ? 1 : 2;
+}
+
+// Relaxation: every relaxable immediate starts at 8 bits and only ever grows,
+// so the program is laid out again until no instruction needs a bigger encoding
+for (;;) {
+    layout();
+    let grown = false;
+    for (const inst of prog) if (inst.type == 'opcode' && inst.imd != undefined && inst.base != undefined) {
+        const size = sizeOf(instructions[inst.name.val].relax?.(inst.args,inst.base) ?? 0);
+        if (size > inst.imd) {
+            inst.imd = size;
+            grown = true;
         }
     }
+    if (!grown)
+        break;
 }
 
 // const result = Buffer.concat([buff.build(),Buffer.from(Array(100).fill(0).map(()=>Math.random()*256))]);
-const result = buff.build();
+const sections = layout();
+let result = sections.code.build();
+
+if (executable) {
+    const data = sections.data.build();
+    const ropd = sections.ropd.build();
+    const bss = sections.bss.getSize();
+    // Every address of a label stored in a section gets relocated, the ones relative to their instruction stay as they are
+    const relocs: Buffer[] = [];
+    for (const inst of prog) if (inst.type == 'opcode') {
+        for (const arg of inst.args) {
+            if (arg.label == undefined || arg.rel || !arg.loc)
+                continue;
+            if (arg.loc.size != 4)
+                throw evalError(inst.name.loc,'Addresses have to be 32 bits wide in executables','Leave the size of the instruction out, or make it `:32`');
+            const section = (Object.keys(sections) as Section[]).find(s => sections[s] == arg.loc?.buffer) ?? 'code';
+            const reloc = Buffer.alloc(8);
+            reloc.writeUInt32LE(arg.loc.addr,0);
+            reloc.writeUInt8(SECTION_IDS[section],4);
+            reloc.writeUInt8(SECTION_IDS[labelSections.get(arg.label) ?? 'code'],5);
+            relocs.push(reloc);
+        }
+    }
+    const entry = vars['entry']?.label ? vars['entry'].val ?? 0 : 0;
+    if (vars['entry']?.label && labelSections.get('entry') != 'code') {
+        console.error(`\x1b[31;1mERROR\x1b[39;22m: The \`entry\` label has to be in the code section`);
+        process.exit(1);
+    }
+    if (result.length > 0x10000 || data.length+bss > 0x10000 || ropd.length > 0x10000) {
+        console.error(`\x1b[31;1mERROR\x1b[39;22m: A section is bigger than its 64K segment`);
+        process.exit(1);
+    }
+    const header = Buffer.alloc(32);
+    [0x58555045,1,entry,result.length,data.length,bss,ropd.length,relocs.length].forEach((v,i) => header.writeUInt32LE(v,i*4));
+    result = Buffer.concat([header,result,data,ropd,...relocs]);
+}
 
 if (outpath) {
     fs.writeFileSync(outpath,result);
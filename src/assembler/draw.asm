@@ -30,8 +30,16 @@ int 0xFF0F
 
 loop:
 
-    ; Handle input
+    ; Wait for a key while none is held
     int 0xFF11
+    cmp ra, 0
+    jne held
+        mov ra, 1
+        int 0x0103
+        jmp loop
+    held:
+
+    ; Handle input
     mov uc, ra
     and ra, 1024
     cmp ra, 0
@@ -65,11 +73,13 @@ loop:
     int 0xFF01
     int 0xFF0F
     
-    ; Pause
-    mov ra, 0
+    ; Sleep until the next frame ( 100 per second )
+    int 0x0101
+    add ra, 40000
+    cmp ra, 40000
+    jle pause
+        add rb, 1
     pause:
-    add ra, 1
-    cmp ra, 10000
-    jge pause
+    int 0x0102
 
 jmp loop
\ No newline at end of file
@@ -177,10 +177,13 @@ loop:
     cal process_input
     cal process_snek
     
-    mov ra, 0
+    ; Sleep until the next frame ( 10 per second )
+    int 0x0101
+    add ra, 400000
+    cmp ra, 400000
+    jle pause
+        add rb, 1
     pause:
-    add ra, 1
-    cmp ra, 30000
-    jge pause
+    int 0x0102
 
 jmp loop
\ No newline at end of file
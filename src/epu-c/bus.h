@@ -0,0 +1,58 @@
+#ifndef bus_h
+#define bus_h
+
+#define BUS_RING_SIZE 32 // Entries of each ring, must be a power of two
+
+/* `epu_call_peripheral` address of a batch of commands: `a` is their amount, the batch itself is at `bus_batch_ptr` */
+#define BUS_BATCH 0xFFFFFFFF
+
+/* Result of a command the host completes later, through `bus_complete` */
+#define BUS_PENDING ((int32_t)0x80000000)
+
+/* Peripherals every host provides ( unknown ones complete with -1 ) */
+#define BUS_DEVICE_CONSOLE 1 // Writes the character `a` to the console of the host, completes with 0
+#define BUS_DEVICE_TIMER   2 // Completes with 0 once `a` milliseconds passed, always later
+
+/* A command queued by the guest, `address` picks the peripheral and the rest is up to it */
+typedef struct bus_command_t {
+    uint32_t address;
+    uint32_t a;
+    uint32_t b;
+    uint32_t c;
+    uint32_t d;
+    uint32_t tag; // Handed back with the result, for the guest to match them
+} bus_command;
+
+/* The result of a command */
+typedef struct bus_completion_t {
+    uint32_t tag;
+    int32_t result;
+} bus_completion;
+
+/*
+    Layout of the rings in the memory of the guest ( `int 0x0400` ), little-endian:
+        uint32_t head          ( commands queued, written by the guest )
+        uint32_t tail          ( commands taken, written by the core )
+        uint32_t done_head     ( completions posted, written by the core )
+        uint32_t done_tail     ( completions read, written by the guest )
+        bus_command    commands[BUS_RING_SIZE]
+        bus_completion completions[BUS_RING_SIZE]
+    Heads and tails count up forever, entries are at their value modulo BUS_RING_SIZE. A guest keeps at most BUS_RING_SIZE
+    commands in flight, the completions of any more than that are dropped.
+*/
+#define BUS_HEAD        0
+#define BUS_TAIL        4
+#define BUS_DONE_HEAD   8
+#define BUS_DONE_TAIL   12
+#define BUS_COMMANDS    16
+#define BUS_COMPLETIONS ( BUS_COMMANDS + BUS_RING_SIZE*24 )
+#define BUS_RING_BYTES  ( BUS_COMPLETIONS + BUS_RING_SIZE*8 )
+
+/* The commands of a doorbell, handed to the host in a single call, which fills `results` ( or sets them to BUS_PENDING ) */
+typedef struct bus_batch_t {
+    uint32_t count;
+    bus_command commands[BUS_RING_SIZE];
+    int32_t results[BUS_RING_SIZE];
+} bus_batch;
+
+#endif
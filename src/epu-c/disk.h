@@ -0,0 +1,31 @@
+#ifndef disk_h
+#define disk_h
+
+/* "EPUD" */
+#define DISK_MAGIC   0x44555045
+#define DISK_VERSION 1
+
+/*
+    Layout of a compressed disk image ( all integers are little-endian ):
+        disk_header
+        chunk index ( `chunks` x disk_chunk )
+        chunk data
+    The image is cut into chunks of `chunk_size` bytes ( the last one can be shorter ), each stored as an LZ4 block ( without
+    a frame ), as is when that wouldn't be smaller, or not at all when it only holds zeroes. The core decompresses a chunk the
+    first time the FAT16 parser reads from it ( tasks/packdisk.py converts raw images ).
+*/
+typedef struct disk_header_t {
+    uint32_t magic;      // DISK_MAGIC
+    uint32_t version;    // DISK_VERSION
+    uint32_t size;       // Size of the raw image in bytes
+    uint32_t chunk_size; // Power of two, from 512 to 65536 bytes
+    uint32_t chunks;     // Amount of chunks, just enough to cover `size`
+} disk_header;
+
+/* Where a chunk is stored */
+typedef struct disk_chunk_t {
+    uint32_t offset; // From the start of the compressed image
+    uint32_t size;   // 0 for a chunk of zeroes, the size of the chunk when it is stored as is, less for an LZ4 block
+} disk_chunk;
+
+#endif
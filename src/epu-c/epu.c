@@ -9,6 +9,12 @@
 
 #include "ge.h"
 #include "epu.h"
+#include "profile.h"
+#include "snapshot.h"
+#include "replay.h"
+#include "bus.h"
+#include "disk.h"
+#include "exec.h"
 #include "data/boot-logos.h"
 #include "data/font.h"
 
@@ -30,16 +36,75 @@
 
 #define SCHED_MAX_INSTRUCTIONS 16
 
+#define EPU_MAX_CORES 8 // Host threads the contexts can be spread over ( see `loop_core` )
+
+// State each core of the machine keeps for itself, every host thread running a core has its own copy ( EPU_THREADS builds )
+#ifdef EPU_THREADS
+#define CORE_LOCAL _Thread_local
+#else
+#define CORE_LOCAL
+#endif
+
+#define CLOCK_HZ 4000000 // Emulated cycles per second
+
+#define EVENT_BITS_KEY   0b00000001 // A key was pressed or released
+#define EVENT_BITS_TIMER 0b00000010 // The wait deadline was reached
+#define EVENT_BITS_VIDEO 0b00000100 // The host presented the last sent frame
+#define EVENT_BITS_BUS   0b00001000 // The host completed a pending command of the peripheral bus
+#define EVENT_MASK_HOST  0b00001101 // Events raised by the host through `epu_event` ( and `bus_complete` )
+
 #define BOOT_FLOPPY_SIZE 1048576
 #define MEM_SEGMENT_SIZE 16777216
 
+#define VERIFY_STACK_SIZE 65536 // Pending addresses of `verify_boot`
+
+#define MEM_PAGE_SIZE  4096
+#define MEM_PAGE_COUNT (65536/MEM_PAGE_SIZE)
+
+#define MEM_SEG_DATA 0
+#define MEM_SEG_CODE 1
+#define MEM_SEG_ROPD 2
+
 #define WIDTH  256
 #define HEIGHT 168
 
+#define VIDEO_MODE_DIRECT  0 // Draws write colors into `screen`
+#define VIDEO_MODE_INDEXED 1 // Draws write palette indices into `screen_indices`, expanded into `screen` when sending the video
+
+// Video RAM, the framebuffers mapped at 0x20xxxxxx for every context
+#define VRAM_PAGE    0x20
+#define VRAM_INDICES 0x000000 // `screen_indices`, a byte per pixel
+#define VRAM_COLORS  0x010000 // `screen`, three bytes ( R, G, B ) per pixel
+#define VRAM_TEXT    0x030000 // `text_cells`, a word per cell
+#define VRAM_SPRITES 0x031000 // `sprites`, SPRITE_COUNT sprite entries
+
+// Text layer, a grid of 8x8 character cells drawn over the framebuffer when sending the video
+#define TEXT_COLS (WIDTH/8)
+#define TEXT_ROWS (HEIGHT/8)
+
 #define ARRSIZE(a) (sizeof(a)/sizeof((a)[0]))
 
+// Video kernels use vector extensions where byte shuffles lower to a single instruction ( wasm SIMD128, SSSE3 / AVX natively )
+#if ( defined(__wasm_simd128__) || defined(__SSSE3__) ) && !defined(EPU_NO_SIMD)
+#define VIDEO_SIMD
+#elif defined(EPU_REQUIRE_SIMD)
+#error "EPU_REQUIRE_SIMD: the video kernels need SIMD128 or SSSE3 ( -msimd128, -mssse3 )"
+#endif
+
+// Color of an image pixel ( 0b0RRGGBBA ), packed like a palette entry
+#define IMAGE_COLOR(v) ( ((v)>>5&3)*85 | ((v)>>3&3)*85<<8 | ((v)>>1&3)*85<<16 )
+#define IMAGE_COLORS4(v)  IMAGE_COLOR(v), IMAGE_COLOR(v+1), IMAGE_COLOR(v+2), IMAGE_COLOR(v+3)
+#define IMAGE_COLORS16(v) IMAGE_COLORS4(v), IMAGE_COLORS4(v+4), IMAGE_COLORS4(v+8), IMAGE_COLORS4(v+12)
+#define IMAGE_COLORS64(v) IMAGE_COLORS16(v), IMAGE_COLORS16(v+16), IMAGE_COLORS16(v+32), IMAGE_COLORS16(v+48)
+
 //// Types ////
 
+#ifdef VIDEO_SIMD
+typedef uint64_t u64x2 __attribute__((vector_size(16)));
+typedef uint32_t u32x4 __attribute__((vector_size(16)));
+typedef uint8_t u8x16 __attribute__((vector_size(16)));
+#endif
+
 typedef struct epu_ctx_t {
     uint8_t alive;
     uint32_t c; // Execution Count ( for scheduler )
@@ -75,6 +140,10 @@ typedef struct epu_ctx_t {
     float fb; // FPU Register B
     float fc; // FPU Register C
     float fd; // FPU Register D
+
+    uint64_t wake; // Cycle at which the context stops sleeping
+    uint32_t wait; // Events the context is blocked on ( see EVENT_BITS_* )
+    uint32_t events; // Events raised since they were last waited on
 } epu_ctx;
 
 typedef struct ctx_memory_t {
@@ -83,22 +152,101 @@ typedef struct ctx_memory_t {
     uint8_t ropd[65536]; // R  process data
 } ctx_memory;
 
+typedef struct ctx_pages_t {
+    uint8_t owner[3][MEM_PAGE_COUNT];  // Space whose memory backs each page ( per segment )
+    uint8_t shared[3][MEM_PAGE_COUNT]; // Amount of other spaces mapping each of the pages owned by this space
+    uint32_t gen[3][MEM_PAGE_COUNT];   // Snapshot generation of the last write to each page ( 0 if it was never written )
+} ctx_pages;
+
 //// Global Vars ////
 
 int boot_floppy_size;
 fat_disk boot_floppy;
+fat_boot_sector boot_floppy_sector;
 int boot_program_size;
 
 color screen[WIDTH*HEIGHT];
+uint8_t screen_indices[WIDTH*HEIGHT];
+uint8_t video_dirty[HEIGHT]; // Rows changed since the video was last sent
+uint32_t text_cells[TEXT_COLS*TEXT_ROWS]; // 0x00BBFFCC: character ( 0 for an empty cell ), foreground and background palette indices
+uint32_t text_drawn[TEXT_COLS*TEXT_ROWS]; // Cells as they were last drawn into the framebuffer
+sprite sprites[SPRITE_COUNT]; // Drawn over the framebuffer when sending the video, in order
+sprite sprites_drawn[SPRITE_COUNT]; // Sprites as they were last sent
+uint8_t sprites_dirty[SPRITE_COUNT]; // Sprites written since the video was last sent
+color frame[WIDTH*HEIGHT]; // Screen with the sprites over it, as sent to the host
+uint32_t video_mode = VIDEO_MODE_DIRECT; // VIDEO_MODE_*
 
 unsigned char boot_floppy_data[BOOT_FLOPPY_SIZE];
+unsigned char boot_floppy_packed[BOOT_FLOPPY_SIZE]; // Image as handed by the host, when it isn't a raw one
+const uint8_t* disk_image; // Compressed image being read ( see disk.h )
+disk_header disk_info;
+uint8_t disk_loaded[BOOT_FLOPPY_SIZE/512]; // Chunks already decompressed
 unsigned char boot_program[MEM_SEGMENT_SIZE];
+uint8_t boot_verified[MEM_SEGMENT_SIZE/8]; // Instructions of the boot program proven well formed, a bit per address they start at ( only `fuse` uses them )
+uint32_t verify_stack[VERIFY_STACK_SIZE];
 
 epu_ctx contexts[256];
-ctx_memory proc_memory[256];
+_Alignas(4) ctx_memory proc_memory[256]; // Aligned values can be updated atomically ( see `atom_apply` )
+ctx_pages proc_pages[256];
+
+CORE_LOCAL uint8_t curr_context = 0;
+CORE_LOCAL uint16_t instruction;
+
+CORE_LOCAL uint32_t cpu_scratch; // Stand in for invalid registers, so that the faulting instruction can finish harmlessly
+CORE_LOCAL float fpu_scratch;
+
+CORE_LOCAL uint64_t epu_cycles = 0; // Emulated clock ( the one of core 0 is the clock of the machine )
+
+CORE_LOCAL uint64_t epu_steps = 0; // Instructions executed since `replay_start`
+
+uint32_t epu_cores = 1; // Cores the contexts are spread over, context `i` runs on core `i % epu_cores`
+CORE_LOCAL uint32_t core_id; // Core run by the current thread
+CORE_LOCAL uint32_t core_locked; // Times the current thread took `core_lock`
+uint8_t core_lock; // Guards the state every core shares, see `core_lock_take`
+uint64_t cores_clock; // Clock of the machine when the cores start a quantum
+uint64_t core_clocks[EPU_MAX_CORES]; // Clock each core reached during the last quantum
+uint64_t core_steps[EPU_MAX_CORES]; // Instructions each core ran during the last quantum
+
+uint32_t replay_mode = REPLAY_OFF; // REPLAY_*
+uint8_t* replay_log; // Log being recorded or replayed
+uint32_t replay_size;
+uint32_t replay_pos;
+uint64_t replay_last; // Value of `epu_steps` at the last entry
+
+uint32_t mem_gen = 1; // Generation written pages are tagged with, bumped by each snapshot
+uint32_t snapshot_gen = 0; // Generation of the last snapshot taken or restored
+
+input_ring epu_input; // Filled by the host, see `input_ring_ptr`
+keys input_keys; // Held keys
+uint8_t input_chars[64]; // Characters waiting to be pulled
+uint8_t input_chars_head;
+uint8_t input_chars_tail;
+int32_t mouse_x;
+int32_t mouse_y;
+uint8_t mouse_buttons;
+
+uint32_t bus_ring = 0; // Where the rings of the peripheral bus are ( 1<<24 | space<<16 | address ), 0 until they are set up
+bus_batch bus_commands; // Commands of the last doorbell, handed to the host ( see `bus_batch_ptr` )
+
+// Cycles taken by each opcode on top of the one needed to dispatch any instruction
+const uint8_t cycle_costs[256] = {
+    [0] = 0, // HLT
+    [1] = 1, // ALU
+    [2] = 1, // MOV
+    [3] = 3, // FPU
+    [4] = 1, // JMP
+    [5] = 1, // CMP
+    [6] = 7, // INT
+    [7] = 3, // CAL
+    [8] = 3, // RET
+    [9] = 3, // ATOM
+    [10] = 3, // PUSH
+    [11] = 3, // POP
+};
 
-uint8_t curr_context = 0;
-uint16_t instruction;
+#ifdef EPU_PROFILE
+profile epu_profile = { .version = PROFILE_VERSION };
+#endif
 
 uint32_t graphics_palette[256] = {
     [0x00] = 0x000000, [0x08] = 0x808080,
@@ -185,75 +333,537 @@ typedef struct graphics_char_t {
 
 graphics_char graphics_chars[1024] = {};
 
+const uint32_t image_colors[256] = { IMAGE_COLORS64(0), IMAGE_COLORS64(64), IMAGE_COLORS64(128), IMAGE_COLORS64(192) };
+
 //// Functions ////
 
+/* Marks rows of the screen as changed, so that the next `send_video` sends them */
+void video_touch( uint32_t y, uint32_t h ) {
+    if (y >= HEIGHT)
+        return;
+    if (h > HEIGHT-y)
+        h = HEIGHT-y;
+    memset(video_dirty+y,1,h);
+}
+
 void clear_screen() {
-    for (int i = 0; i < WIDTH*HEIGHT; i++) {
-        screen[i].r =
-        screen[i].g =
-        screen[i].b = 0;
+    memset(screen,0,sizeof(screen));
+    video_touch(0,HEIGHT);
+}
+
+/* Converts a row of 8-bit indexed pixels into colors, through a palette ( usually `graphics_palette` ) */
+void expand_palette( color* dst, const uint8_t* src, uint32_t n, const uint32_t* palette ) {
+    size_t i = 0;
+#ifdef VIDEO_SIMD
+    for (; i+8 <= n; i += 8) { // 8 pixels ( 24 bytes ) at a time, dropping the 4th byte of each palette entry
+        const u32x4 a = { palette[src[i+0]], palette[src[i+1]], palette[src[i+2]], palette[src[i+3]] };
+        const u32x4 b = { palette[src[i+4]], palette[src[i+5]], palette[src[i+6]], palette[src[i+7]] };
+        const u8x16 lo = __builtin_shufflevector((u8x16)a,(u8x16)b,0,1,2,4,5,6,8,9,10,12,13,14,16,17,18,20);
+        const u8x16 hi = __builtin_shufflevector((u8x16)b,(u8x16)b,5,6,8,9,10,12,13,14,0,0,0,0,0,0,0,0);
+        __builtin_memcpy((uint8_t*)(dst+i),&lo,16);
+        __builtin_memcpy((uint8_t*)(dst+i)+16,&hi,8);
+    }
+#endif
+    for (; i < n; i++) {
+        const uint32_t c = palette[src[i]];
+        dst[i] = (color){ c&255, (c>>8)&255, (c>>16)&255 };
     }
 }
 
-void send_video() {
-    ge_screen_set(screen, 0, 0, WIDTH, HEIGHT);
-    ge_screen_push();
+/* Draws a character at pixel coordinates ( it has to fit on the screen ), with palette indices for its colors */
+void draw_char( uint32_t x, uint32_t y, uint32_t c, uint8_t fg, uint8_t bg ) {
+    uint8_t* chardata = graphics_chars[0].data;
+    for (size_t i = 0; i < ARRSIZE(graphics_chars); i++) {
+        if (graphics_chars[i].character == c) {
+            chardata = graphics_chars[i].data;
+            break;
+        }
+    }
+
+    for (size_t dy = 0; dy < 8; dy++) {
+        uint8_t l = chardata[dy];
+        uint8_t row[8];
+        for (size_t dx = 0; dx < 8; dx++)
+            row[dx] = l&(1<<(7-dx)) ? fg : bg;
+        if (video_mode == VIDEO_MODE_INDEXED)
+            memcpy(&screen_indices[(y+dy)*WIDTH+x],row,8);
+        else
+            expand_palette(&screen[(y+dy)*WIDTH+x],row,8,graphics_palette);
+    }
+    video_touch(y,8);
+}
+
+/* Draws the cells of the text layer that changed since they were last drawn ( empty cells leave the framebuffer as it is ) */
+void text_composite() {
+    for (uint32_t i = 0; i < TEXT_COLS*TEXT_ROWS; i++) {
+        const uint32_t cell = text_cells[i];
+        if (cell == text_drawn[i])
+            continue;
+        text_drawn[i] = cell;
+        if (cell&255)
+            draw_char(i%TEXT_COLS*8,i/TEXT_COLS*8,cell&255,cell>>8,cell>>16);
+    }
+}
+
+#ifdef VIDEO_SIMD
+/* Draws 8 colors ( two vectors of palette entries ) over the ones at `dst`, where the first 8 lanes of the mask are set */
+void blend8( color* dst, u32x4 a, u32x4 b, u8x16 m ) {
+    uint64_t prev;
+    const u8x16 lo = __builtin_shufflevector((u8x16)a,(u8x16)b,0,1,2,4,5,6,8,9,10,12,13,14,16,17,18,20);
+    const u8x16 hi = __builtin_shufflevector((u8x16)b,(u8x16)b,5,6,8,9,10,12,13,14,0,0,0,0,0,0,0,0);
+    const u8x16 mlo = __builtin_shufflevector(m,m,0,0,0,1,1,1,2,2,2,3,3,3,4,4,4,5);
+    const u8x16 mhi = __builtin_shufflevector(m,m,5,5,6,6,6,7,7,7,8,8,8,8,8,8,8,8);
+    u8x16 plo;
+    __builtin_memcpy(&plo,(uint8_t*)dst,16);
+    __builtin_memcpy(&prev,(uint8_t*)dst+16,8);
+    plo = (lo&mlo) | (plo&~mlo);
+    const u8x16 phi = (hi&mhi) | ((u8x16)(u64x2){ prev, 0 }&~mhi);
+    __builtin_memcpy((uint8_t*)dst,&plo,16);
+    __builtin_memcpy((uint8_t*)dst+16,&phi,8);
+}
+#endif
+
+/* Draws a row of image pixels ( 0b0RRGGBBA ) over colors, skipping the transparent ones */
+void blit_row( color* dst, const uint8_t* src, size_t n ) {
+    size_t i = 0;
+#ifdef VIDEO_SIMD
+    for (; i+8 <= n; i += 8) { // Same as `expand_palette`, blended with the previous colors through the alpha bits
+        const u32x4 a = { image_colors[src[i+0]], image_colors[src[i+1]], image_colors[src[i+2]], image_colors[src[i+3]] };
+        const u32x4 b = { image_colors[src[i+4]], image_colors[src[i+5]], image_colors[src[i+6]], image_colors[src[i+7]] };
+        uint64_t alpha;
+        __builtin_memcpy(&alpha,src+i,8);
+        blend8(dst+i,a,b,-((u8x16)(u64x2){ alpha, 0 }&1));
+    }
+#endif
+    for (; i < n; i++) {
+        if (src[i]&1) {
+            const uint32_t c = image_colors[src[i]];
+            dst[i] = (color){ c&255, (c>>8)&255, (c>>16)&255 };
+        }
+    }
+}
+
+/* Draws a row of sprite pixels over colors, skipping the zeros of keyed sprites */
+void sprite_row( color* dst, const uint8_t* src, uint32_t n, uint8_t add, int keyed ) {
+    const uint32_t* palette = graphics_palette;
+    const uint8_t* idx = src;
+    uint8_t shifted[256];
+    if (add) { // Only sprites with a color offset need their indices moved first
+        for (size_t i = 0; i < n; i++)
+            shifted[i] = src[i]+add;
+        idx = shifted;
+    }
+    if (!keyed) {
+        expand_palette(dst,idx,n,palette);
+        return;
+    }
+    size_t i = 0;
+#ifdef VIDEO_SIMD
+    for (; i+8 <= n; i += 8) {
+        const u32x4 a = { palette[idx[i+0]], palette[idx[i+1]], palette[idx[i+2]], palette[idx[i+3]] };
+        const u32x4 b = { palette[idx[i+4]], palette[idx[i+5]], palette[idx[i+6]], palette[idx[i+7]] };
+        uint64_t keys;
+        __builtin_memcpy(&keys,src+i,8);
+        blend8(dst+i,a,b,(u8x16)((u8x16)(u64x2){ keys, 0 } != 0));
+    }
+#endif
+    for (; i < n; i++) {
+        if (src[i]) {
+            const uint32_t c = palette[idx[i]];
+            dst[i] = (color){ c&255, (c>>8)&255, (c>>16)&255 };
+        }
+    }
 }
 
 void blit_image(image* img, int ox, int oy) {
-    for (int x = 0; x < img->w; x++) {
-        for (int y = 0; y < img->h; y++) {
-            const int v = img->img[x+y*img->w];
-            if (v&1) {
-                screen[x+ox+(y+oy)*WIDTH].r = ((img->img[x+y*img->w]>>5)&3)*85;
-                screen[x+ox+(y+oy)*WIDTH].g = ((img->img[x+y*img->w]>>3)&3)*85;
-                screen[x+ox+(y+oy)*WIDTH].b = ((img->img[x+y*img->w]>>1)&3)*85;
-            }
+    for (int y = 0; y < img->h; y++)
+        blit_row(screen+ox+(y+oy)*WIDTH,img->img+y*img->w,img->w);
+    video_touch(oy,img->h);
+}
+
+/* Checks that `size` bytes at `off` lie within the `len` bytes at `base`, without any of it wrapping around */
+int vram_fits( uint32_t off, uint32_t size, uint32_t base, uint32_t len ) {
+    return size <= len && off-base <= len-size;
+}
+
+/* Returns the framebuffer bytes at an offset of the video RAM, NULL unless all `size` of them are mapped */
+uint8_t* vram_ptr( uint32_t off, uint32_t size ) {
+    if ( vram_fits(off,size,VRAM_INDICES,sizeof(screen_indices)) )
+        return screen_indices+off-VRAM_INDICES;
+    if ( vram_fits(off,size,VRAM_COLORS,sizeof(screen)) )
+        return (uint8_t*)screen+off-VRAM_COLORS;
+    if ( vram_fits(off,size,VRAM_TEXT,sizeof(text_cells)) )
+        return (uint8_t*)text_cells+off-VRAM_TEXT;
+    if ( vram_fits(off,size,VRAM_SPRITES,sizeof(sprites)) )
+        return (uint8_t*)sprites+off-VRAM_SPRITES;
+    return 0;
+}
+
+/* Marks the rows or the sprites a write to the video RAM went to as changed ( text cells are compared with what was drawn instead ) */
+void vram_touch( uint32_t off, uint32_t size ) {
+    if (!size || !vram_ptr(off,size)) // Ranges that aren't mapped weren't written
+        return;
+    if (off >= VRAM_SPRITES) {
+        for (uint32_t i = (off-VRAM_SPRITES)/sizeof(sprite); i <= (off+size-1-VRAM_SPRITES)/sizeof(sprite); i++)
+            sprites_dirty[i] = 1;
+        return;
+    }
+    if (off >= VRAM_TEXT)
+        return;
+    const uint32_t stride = off < VRAM_COLORS ? WIDTH : WIDTH*3;
+    const uint32_t base = off < VRAM_COLORS ? VRAM_INDICES : VRAM_COLORS;
+    const uint32_t y = (off-base)/stride;
+    video_touch(y,(off+size-1-base)/stride-y+1);
+}
+
+/*
+    Takes the lock guarding what the cores share while running a quantum: the memory mappings ( copy-on-write ), the video,
+    the input, the host calls and the contexts of other cores. Interrupts run with it held. The same thread can take it again,
+    and it isn't needed with a single core.
+*/
+void core_lock_take() {
+    if (epu_cores > 1 && !core_locked++) {
+        while (__atomic_test_and_set(&core_lock,__ATOMIC_ACQUIRE))
+            ;
+    }
+}
+
+/* Releases `core_lock` */
+void core_lock_drop() {
+    if (epu_cores > 1 && !--core_locked)
+        __atomic_clear(&core_lock,__ATOMIC_RELEASE);
+}
+
+/* Returns a segment of the memory of a context space */
+uint8_t* mem_segment( uint8_t space, uint8_t seg ) {
+    if (seg == MEM_SEG_CODE)
+        return proc_memory[space].code;
+    if (seg == MEM_SEG_ROPD)
+        return proc_memory[space].ropd;
+    return proc_memory[space].data;
+}
+
+/* Returns the byte backing an address of a segment of a space, for reading */
+uint8_t* mem_read_ptr( uint8_t space, uint8_t seg, uint16_t addr ) {
+    return mem_segment(__atomic_load_n(&proc_pages[space].owner[seg][addr/MEM_PAGE_SIZE],__ATOMIC_RELAXED),seg)+addr;
+}
+
+/* Gives a space its own copy of a page it was mapping from another space */
+void mem_page_unshare( uint8_t space, uint8_t seg, uint8_t page ) {
+    const uint8_t owner = proc_pages[space].owner[seg][page];
+    memcpy(mem_segment(space,seg)+page*MEM_PAGE_SIZE,mem_segment(owner,seg)+page*MEM_PAGE_SIZE,MEM_PAGE_SIZE);
+    __atomic_store_n(&proc_pages[space].owner[seg][page],space,__ATOMIC_RELAXED); // Other cores read the mappings without the lock
+    __atomic_store_n(&proc_pages[space].gen[seg][page],mem_gen,__ATOMIC_RELAXED);
+    __atomic_fetch_sub(&proc_pages[owner].shared[seg][page],1,__ATOMIC_RELAXED);
+}
+
+/* Hands out private copies of a page of a space to all the spaces still mapping it */
+void mem_page_detach( uint8_t space, uint8_t seg, uint8_t page ) {
+    for (size_t i = 0; i < 256 && proc_pages[space].shared[seg][page]; i++) {
+        if (i != space && proc_pages[i].owner[seg][page] == space)
+            mem_page_unshare(i,seg,page);
+    }
+}
+
+/* Returns the byte backing an address of a segment of a space, for writing ( copies shared pages first ) */
+uint8_t* mem_write_ptr( uint8_t space, uint8_t seg, uint16_t addr ) {
+    const uint8_t page = addr/MEM_PAGE_SIZE;
+    if (__atomic_load_n(&proc_pages[space].owner[seg][page],__ATOMIC_RELAXED) != space || __atomic_load_n(&proc_pages[space].shared[seg][page],__ATOMIC_RELAXED)) { // Copies change the mappings of other spaces
+        core_lock_take();
+        if (proc_pages[space].owner[seg][page] != space)
+            mem_page_unshare(space,seg,page);
+        else if (proc_pages[space].shared[seg][page])
+            mem_page_detach(space,seg,page);
+        core_lock_drop();
+    }
+    __atomic_store_n(&proc_pages[space].gen[seg][page],mem_gen,__ATOMIC_RELAXED); // Cores writing the same page store the same generation
+    return mem_segment(space,seg)+addr;
+}
+
+/* Maps the segments ( bitmask of 1<<MEM_SEG_* ) of a space into another one, copy-on-write */
+void mem_share( uint8_t dst, uint8_t src, uint8_t segs ) {
+    for (uint8_t seg = 0; seg < 3; seg++) if (segs&(1<<seg)) {
+        for (uint8_t page = 0; page < MEM_PAGE_COUNT; page++) {
+            const uint8_t owner = proc_pages[src].owner[seg][page];
+            const uint8_t prev = proc_pages[dst].owner[seg][page];
+            if (owner == prev)
+                continue;
+            if (prev != dst)
+                __atomic_fetch_sub(&proc_pages[prev].shared[seg][page],1,__ATOMIC_RELAXED);
+            else if (proc_pages[dst].shared[seg][page])
+                mem_page_detach(dst,seg,page);
+            __atomic_store_n(&proc_pages[dst].owner[seg][page],owner,__ATOMIC_RELAXED);
+            if (owner != dst)
+                __atomic_fetch_add(&proc_pages[owner].shared[seg][page],1,__ATOMIC_RELAXED);
         }
     }
 }
 
+/* Finds the space and segment an address resolves to for a context, returns 0 if it can't be accessed, 1 for a segment, 2 for the boot code and 3 for the video RAM */
+int mem_region( epu_ctx* ctx, uint32_t addr, int write, uint8_t* space, uint8_t* seg ) {
+    uint8_t p = addr >> 24;
+    uint8_t s = addr >> 16;
+    if ( p <= 0x0F ) { // Bound RAM
+        *space = ctx->s; *seg = MEM_SEG_DATA;
+        return 1;
+    }
+    if ( !write && p == 0x10 ) { // Bound Code
+        *space = ctx->s; *seg = MEM_SEG_CODE;
+        return 1;
+    }
+    if ( !write && p == 0x11 ) { // Bound Data
+        *space = ctx->s; *seg = MEM_SEG_DATA;
+        return 1;
+    }
+    if ( !write && p == 0x12 ) { // Bound Read-Only Data
+        *space = ctx->s; *seg = MEM_SEG_ROPD;
+        return 1;
+    }
+    if ( !ctx->s && p >= 0xD0 && p <= 0xDF ) { // Specific RAM
+        *space = s; *seg = MEM_SEG_DATA;
+        return 1;
+    }
+    if ( !ctx->s && !write && p == 0xE0 ) { // Specific Code
+        *space = s; *seg = MEM_SEG_CODE;
+        return 1;
+    }
+    if ( !ctx->s && !write && p == 0xE1 ) { // Specific Data
+        *space = s; *seg = MEM_SEG_DATA;
+        return 1;
+    }
+    if ( !ctx->s && !write && p == 0xE2 ) { // Specific Read-Only Data
+        *space = s; *seg = MEM_SEG_ROPD;
+        return 1;
+    }
+    if ( !ctx->s && !write && p == 0xFF ) { // Boot Code
+        return 2;
+    }
+    if ( p == VRAM_PAGE ) { // Video RAM
+        return 3;
+    }
+    return 0;
+}
+
+/* Checks that a whole range can be accessed by a context without wrapping around its region */
+int mem_check_range( epu_ctx* ctx, uint32_t addr, uint32_t size, int write ) {
+    uint8_t space, seg;
+    const int region = mem_region(ctx,addr,write,&space,&seg);
+    if (!region)
+        return 1;
+    if (region == 3)
+        return size && !vram_ptr(addr&0xFFFFFF,size);
+    const uint32_t window = region == 2 ? 0xFFFFFF : 0xFFFF;
+    return size && size-1 > window-(addr&window);
+}
+
+/* Returns the address `off` bytes into a range checked by `mem_check_range`, without leaving the window of its region */
+uint32_t mem_advance( uint32_t addr, uint32_t off ) {
+    const uint32_t window = addr>>24 == 0xFF || addr>>24 == VRAM_PAGE ? 0xFFFFFF : 0xFFFF;
+    return (addr&~window) | ((addr+off)&window);
+}
+
+/* Returns the host memory backing an address, valid up to the end of its page */
+uint8_t* mem_span( epu_ctx* ctx, uint32_t addr, int write ) {
+    uint8_t space, seg;
+    const int region = mem_region(ctx,addr,write,&space,&seg);
+    if (region == 2)
+        return boot_program+(addr&0xFFFFFF);
+    if (region == 3)
+        return vram_ptr(addr&0xFFFFFF,1);
+    return write ? mem_write_ptr(space,seg,addr) : mem_read_ptr(space,seg,addr);
+}
+
+/* Copies a range of memory in bulk, page by page ( overlapping ranges behave like memmove ) */
+int mem_copy( epu_ctx* ctx, uint32_t dst, uint32_t src, uint32_t size ) {
+    if (mem_check_range(ctx,src,size,0)) {
+        ctx->flags |= STATUS_BITS_READERR;
+        return 1;
+    }
+    if (mem_check_range(ctx,dst,size,1)) {
+        ctx->flags |= STATUS_BITS_WRITERR;
+        return 1;
+    }
+    if (dst>>24 == VRAM_PAGE)
+        vram_touch(dst&0xFFFFFF,size);
+    uint8_t src_space, src_seg, dst_space, dst_seg;
+    const int src_region = mem_region(ctx,src,0,&src_space,&src_seg);
+    const int dst_region = mem_region(ctx,dst,1,&dst_space,&dst_seg);
+    const int aliased = src_region == dst_region && (dst_region != 1 || (src_space == dst_space && src_seg == dst_seg)); // Windows can map the same bytes at different addresses
+    const uint32_t window = dst_region == 3 ? 0xFFFFFF : 0xFFFF;
+    const int backwards = aliased && (dst&window) > (src&window);
+    while (size) {
+        uint32_t n = size;
+        uint32_t off = 0;
+        if (backwards) {
+            const uint32_t sn = (mem_advance(src,size-1)&(MEM_PAGE_SIZE-1))+1;
+            const uint32_t dn = (mem_advance(dst,size-1)&(MEM_PAGE_SIZE-1))+1;
+            if (sn < n) n = sn;
+            if (dn < n) n = dn;
+            off = size-n;
+        } else {
+            const uint32_t sn = MEM_PAGE_SIZE-(src&(MEM_PAGE_SIZE-1));
+            const uint32_t dn = MEM_PAGE_SIZE-(dst&(MEM_PAGE_SIZE-1));
+            if (sn < n) n = sn;
+            if (dn < n) n = dn;
+        }
+        memmove(mem_span(ctx,mem_advance(dst,off),1),mem_span(ctx,mem_advance(src,off),0),n);
+        if (!backwards) {
+            src = mem_advance(src,n);
+            dst = mem_advance(dst,n);
+        }
+        size -= n;
+    }
+    return 0;
+}
+
+/* Fills a range of memory in bulk, page by page */
+int mem_fill( epu_ctx* ctx, uint32_t dst, uint8_t value, uint32_t size ) {
+    if (mem_check_range(ctx,dst,size,1)) {
+        ctx->flags |= STATUS_BITS_WRITERR;
+        return 1;
+    }
+    if (dst>>24 == VRAM_PAGE)
+        vram_touch(dst&0xFFFFFF,size);
+    while (size) {
+        uint32_t n = MEM_PAGE_SIZE-(dst&(MEM_PAGE_SIZE-1));
+        if (size < n) n = size;
+        memset(mem_span(ctx,dst,1),value,n);
+        dst = mem_advance(dst,n);
+        size -= n;
+    }
+    return 0;
+}
+
+/* Copies bytes out of a segment of a space, wrapping around at its end like `read_data` */
+void mem_read_bytes( uint8_t space, uint8_t seg, uint16_t addr, uint8_t* dst, uint32_t n ) {
+    while (n) {
+        uint32_t k = MEM_PAGE_SIZE-(addr&(MEM_PAGE_SIZE-1));
+        if (n < k) k = n;
+        memcpy(dst,mem_read_ptr(space,seg,addr),k);
+        dst += k;
+        addr += k;
+        n -= k;
+    }
+}
+
+/* Marks the rows a sprite covers as changed */
+void sprite_touch( const sprite* spr ) {
+    if (!spr->w || !spr->h || spr->y >= HEIGHT || spr->y+spr->h <= 0)
+        return;
+    const int32_t y = spr->y < 0 ? 0 : spr->y;
+    video_touch(y,spr->y+spr->h-y);
+}
+
+/* Marks the rows of the sprites written since the video was last sent as changed, both where they were and where they are */
+void sprites_touch() {
+    for (size_t i = 0; i < SPRITE_COUNT; i++) {
+        if (!sprites_dirty[i])
+            continue;
+        sprite_touch(&sprites_drawn[i]);
+        sprite_touch(&sprites[i]);
+        sprites_drawn[i] = sprites[i];
+        sprites_dirty[i] = 0;
+    }
+}
+
+/* Draws the sprites over rows of the frame, clipping each of their rows to the screen before reading it */
+void sprites_draw( uint32_t y0, uint32_t y1 ) {
+    uint8_t row[256];
+    for (size_t i = 0; i < SPRITE_COUNT; i++) {
+        const sprite* spr = &sprites[i];
+        if (spr->seg != MEM_SEG_DATA && spr->seg != MEM_SEG_ROPD)
+            continue;
+        const int32_t top = spr->y > (int32_t)y0 ? spr->y : (int32_t)y0;
+        const int32_t bottom = spr->y+spr->h < (int32_t)y1 ? spr->y+spr->h : (int32_t)y1;
+        const int32_t left = spr->x > 0 ? spr->x : 0;
+        const int32_t right = spr->x+spr->w < WIDTH ? spr->x+spr->w : WIDTH;
+        if (top >= bottom || left >= right)
+            continue;
+        for (int32_t y = top; y < bottom; y++) {
+            mem_read_bytes(spr->space,spr->seg,spr->addr+(y-spr->y)*spr->w+(left-spr->x),row,right-left);
+            sprite_row(frame+y*WIDTH+left,row,right-left,spr->color,spr->flags&SPRITE_BITS_KEYED);
+        }
+    }
+}
+
+/* Sends the rows that changed to the host ( expanding the indices first in indexed mode, then drawing the sprites over them ) and presents them */
+void send_video() {
+    text_composite();
+    sprites_touch();
+    for (uint32_t y = 0; y < HEIGHT;) {
+        if (!video_dirty[y]) {
+            y++;
+            continue;
+        }
+        uint32_t end = y;
+        while (end < HEIGHT && video_dirty[end])
+            end++;
+        if (video_mode == VIDEO_MODE_INDEXED)
+            expand_palette(screen+y*WIDTH,screen_indices+y*WIDTH,(end-y)*WIDTH,graphics_palette);
+        memcpy(frame+y*WIDTH,screen+y*WIDTH,(end-y)*WIDTH*sizeof(color));
+        sprites_draw(y,end);
+        ge_screen_set(frame, 0, y, WIDTH, end-y);
+        y = end;
+    }
+    memset(video_dirty,0,sizeof(video_dirty));
+    ge_screen_push();
+}
+
 int read_data( epu_ctx* ctx, uint32_t* addr, uint32_t size, void* dest ) {
     uint8_t p = *addr >> 24;
     uint8_t s = *addr >> 16;
     if ( p >= 0x00 && p <= 0x0F ) { // Bound RAM
         for (size_t i = 0; i < size; i++) {
-            ((uint8_t*)dest)[i] = proc_memory[ctx->s].data[((*addr)++)&0xFFFFFF];
+            ((uint8_t*)dest)[i] = *mem_read_ptr(ctx->s,MEM_SEG_DATA,(*addr)++);
             *addr &= 0xFFFFFF;
         }
         return 0;
     }
     else if ( p == 0x10 ) { // Bound Code
         for (size_t i = 0; i < size; i++) {
-            ((uint8_t*)dest)[i] = proc_memory[ctx->s].code[((*addr)++)&0xFFFF];
+            ((uint8_t*)dest)[i] = *mem_read_ptr(ctx->s,MEM_SEG_CODE,(*addr)++);
             *addr &= 0xFFFF; *addr |= (((uint32_t)p)<<24)|(((uint32_t)s)<<16);
         }
         return 0;
     }
     else if (p == 0x11 ) { // Bound Data
         for (size_t i = 0; i < size; i++) {
-            ((uint8_t*)dest)[i] = proc_memory[ctx->s].data[((*addr)++)&0xFFFF];
+            ((uint8_t*)dest)[i] = *mem_read_ptr(ctx->s,MEM_SEG_DATA,(*addr)++);
+            *addr &= 0xFFFF; *addr |= (((uint32_t)p)<<24)|(((uint32_t)s)<<16);
+        }
+        return 0;
+    }
+    else if ( p == 0x12 ) { // Bound Read-Only Data
+        for (size_t i = 0; i < size; i++) {
+            ((uint8_t*)dest)[i] = *mem_read_ptr(ctx->s,MEM_SEG_ROPD,(*addr)++);
             *addr &= 0xFFFF; *addr |= (((uint32_t)p)<<24)|(((uint32_t)s)<<16);
         }
         return 0;
     }
     else if ( !ctx->s && p >= 0xD0 && p <= 0xDF ) { // Specific RAM
         for (size_t i = 0; i < size; i++) {
-            ((uint8_t*)dest)[i] = proc_memory[s].data[((*addr)++)&0xFFFF];
+            ((uint8_t*)dest)[i] = *mem_read_ptr(s,MEM_SEG_DATA,(*addr)++);
             *addr &= 0xFFFF; *addr |= (((uint32_t)p)<<24)|(((uint32_t)s)<<16);
         }
         return 0;
     }
     else if ( !ctx->s && p == 0xE0 ) { // Specific Code
         for (size_t i = 0; i < size; i++) {
-            ((uint8_t*)dest)[i] = proc_memory[s].code[((*addr)++)&0xFFFF];
+            ((uint8_t*)dest)[i] = *mem_read_ptr(s,MEM_SEG_CODE,(*addr)++);
             *addr &= 0xFFFF; *addr |= (((uint32_t)p)<<24)|(((uint32_t)s)<<16);
         }
         return 0;
     }
     else if ( !ctx->s && p == 0xE1 ) { // Specific Data
         for (size_t i = 0; i < size; i++) {
-            ((uint8_t*)dest)[i] = proc_memory[s].data[((*addr)++)&0xFFFF];
+            ((uint8_t*)dest)[i] = *mem_read_ptr(s,MEM_SEG_DATA,(*addr)++);
+            *addr &= 0xFFFF; *addr |= (((uint32_t)p)<<24)|(((uint32_t)s)<<16);
+        }
+        return 0;
+    }
+    else if ( !ctx->s && p == 0xE2 ) { // Specific Read-Only Data
+        for (size_t i = 0; i < size; i++) {
+            ((uint8_t*)dest)[i] = *mem_read_ptr(s,MEM_SEG_ROPD,(*addr)++);
             *addr &= 0xFFFF; *addr |= (((uint32_t)p)<<24)|(((uint32_t)s)<<16);
         }
         return 0;
@@ -265,6 +875,11 @@ int read_data( epu_ctx* ctx, uint32_t* addr, uint32_t size, void* dest ) {
         }
         return 0;
     }
+    else if ( p == VRAM_PAGE && vram_ptr(*addr&0xFFFFFF,size) ) { // Video RAM ( the whole access has to be mapped )
+        memcpy(dest,vram_ptr(*addr&0xFFFFFF,size),size);
+        *addr += size;
+        return 0;
+    }
     ctx->flags |= STATUS_BITS_READERR;
     return 1;
 }
@@ -278,22 +893,145 @@ int write_data( epu_ctx* ctx, uint32_t addr, uint32_t size, void* data ) {
     uint8_t s = addr >> 16;
     if ( p >= 0x00 && p <= 0x0F ) { // Bound RAM
         for (size_t i = 0; i < size; i++) {
-            proc_memory[ctx->s].data[addr++] = ((uint8_t*)data)[i];
+            *mem_write_ptr(ctx->s,MEM_SEG_DATA,addr++) = ((uint8_t*)data)[i];
             addr &= 0xFFFF;
         }
         return 0;
     }
     else if ( !ctx->s && p >= 0xD0 && p <= 0xDF ) { // Specific RAM
         for (size_t i = 0; i < size; i++) {
-            proc_memory[s].data[addr++] = ((uint8_t*)data)[i];
+            *mem_write_ptr(s,MEM_SEG_DATA,addr++) = ((uint8_t*)data)[i];
             addr &= 0xFFFF;
         }
         return 0;
     }
+    else if ( p == VRAM_PAGE && vram_ptr(addr&0xFFFFFF,size) ) { // Video RAM ( the whole access has to be mapped )
+        core_lock_take();
+        memcpy(vram_ptr(addr&0xFFFFFF,size),data,size);
+        vram_touch(addr&0xFFFFFF,size);
+        core_lock_drop();
+        return 0;
+    }
     ctx->flags |= STATUS_BITS_WRITERR;
     return 1;
 }
 
+/* Copies bytes between the host and a range of memory of a context in bulk, page by page, returns 1 if it can't be accessed */
+int mem_transfer( epu_ctx* ctx, uint32_t addr, uint8_t* data, uint32_t size, int write ) {
+    if (mem_check_range(ctx,addr,size,write)) {
+        ctx->flags |= write ? STATUS_BITS_WRITERR : STATUS_BITS_READERR;
+        return 1;
+    }
+    if (addr>>24 == VRAM_PAGE) // Takes the lock and marks what changed
+        return write ? write_data(ctx,addr,size,data) : peek_data(ctx,addr,size,data);
+    while (size) {
+        uint32_t n = MEM_PAGE_SIZE-(addr&(MEM_PAGE_SIZE-1));
+        if (size < n) n = size;
+        if (write)
+            memcpy(mem_span(ctx,addr,1),data,n);
+        else
+            memcpy(data,mem_span(ctx,addr,0),n);
+        addr = mem_advance(addr,n);
+        data += n;
+        size -= n;
+    }
+    return 0;
+}
+
+/* Makes a page of a space read as zeroes, only clearing it if it was ever written */
+void mem_page_zero( uint8_t space, uint8_t seg, uint8_t page ) {
+    const uint8_t owner = proc_pages[space].owner[seg][page];
+    if (owner != space) { // Maps the page of the space itself back, which can be dirty from before it mapped another one
+        __atomic_store_n(&proc_pages[space].owner[seg][page],space,__ATOMIC_RELAXED);
+        __atomic_fetch_sub(&proc_pages[owner].shared[seg][page],1,__ATOMIC_RELAXED);
+    }
+    if (!proc_pages[space].gen[seg][page]) // Never written, still zeroes
+        return;
+    if (proc_pages[space].shared[seg][page])
+        mem_page_detach(space,seg,page);
+    memset(mem_segment(space,seg)+page*MEM_PAGE_SIZE,0,MEM_PAGE_SIZE);
+    __atomic_store_n(&proc_pages[space].gen[seg][page],mem_gen,__ATOMIC_RELAXED);
+}
+
+/* Adds to the 32-bit word at an offset of a section `exec_load` loaded ( the code of the boot program is still where it was read from ) */
+void exec_patch( uint8_t space, int boot, uint8_t section, uint32_t offset, uint32_t add ) {
+    static const uint8_t segs[3] = { MEM_SEG_CODE, MEM_SEG_DATA, MEM_SEG_ROPD };
+    if (boot && section == EXEC_SECTION_CODE) {
+        uint8_t* const b = boot_program+sizeof(exec_header)+offset;
+        const uint32_t v = (b[0] | b[1]<<8 | b[2]<<16 | (uint32_t)b[3]<<24) + add;
+        for (size_t i = 0; i < 4; i++)
+            b[i] = v>>(i*8);
+        return;
+    }
+    uint32_t v = 0;
+    for (size_t i = 0; i < 4; i++)
+        v |= (uint32_t)*mem_read_ptr(space,segs[section],offset+i) << (i*8);
+    v += add;
+    for (size_t i = 0; i < 4; i++)
+        *mem_write_ptr(space,segs[section],offset+i) = v>>(i*8);
+}
+
+/*
+    Loads an executable ( see exec.h ) a context can read at `image` into the segments of a space, or the code of the boot
+    program when `boot` is set ( `image` being that program ). The pages the sections don't cover are only cleared if they
+    were written, so the bss and the rest of the segments cost nothing. Returns the address of the entry point, 0 if the
+    executable is malformed or stored in the space it would be loaded into ( the space is left as it is ).
+*/
+uint32_t exec_load( epu_ctx* ctx, uint32_t image, uint32_t size, uint8_t space, int boot ) {
+    static const uint8_t segs[3] = { MEM_SEG_CODE, MEM_SEG_DATA, MEM_SEG_ROPD };
+    exec_header h;
+    uint8_t image_space, image_seg;
+    if (size < sizeof(h) || mem_check_range(ctx,image,size,0))
+        return 0;
+    if (mem_region(ctx,image,0,&image_space,&image_seg) == 1 && image_space == space)
+        return 0; // The rest of the image would be read back from segments that were already overwritten
+    peek_data(ctx,image,sizeof(h),&h);
+    if (h.magic != EXEC_MAGIC || h.version != EXEC_VERSION || h.entry >= h.code_size)
+        return 0;
+    if ((!boot && h.code_size > 65536) || h.data_size > 65536 || h.bss_size > 65536-h.data_size || h.ropd_size > 65536)
+        return 0;
+    const uint32_t sizes[3] = { h.code_size, h.data_size, h.ropd_size };
+    const uint64_t relocs = (uint64_t)sizeof(h)+h.code_size+h.data_size+h.ropd_size;
+    if (relocs+(uint64_t)h.relocs*sizeof(exec_reloc) > size)
+        return 0;
+    for (uint32_t i = 0; i < h.relocs; i++) {
+        exec_reloc r;
+        peek_data(ctx,image+relocs+i*sizeof(r),sizeof(r),&r);
+        if (r.section > 2 || r.target > 2 || sizes[r.section] < 4 || r.offset > sizes[r.section]-4)
+            return 0;
+    }
+
+    uint32_t at = image+sizeof(h);
+    for (uint8_t section = 0; section < 3; section++) {
+        const uint8_t seg = segs[section];
+        const uint32_t n = sizes[section];
+        if (boot && section == EXEC_SECTION_CODE) { // Moved into place last, the other sections are read after it
+            at += n;
+            continue;
+        }
+        for (uint32_t page = 0; page < MEM_PAGE_COUNT; page++) {
+            if ((page+1)*MEM_PAGE_SIZE > n)
+                mem_page_zero(space,seg,page);
+        }
+        for (uint32_t off = 0; off < n; off += MEM_PAGE_SIZE)
+            peek_data(ctx,at+off,n-off < MEM_PAGE_SIZE ? n-off : MEM_PAGE_SIZE,mem_write_ptr(space,seg,off));
+        at += n;
+    }
+
+    const uint32_t bases[3] = { boot ? 0xFF000000 : 0x10000000, 0x00000000, 0x12000000 };
+    for (uint32_t i = 0; i < h.relocs; i++) {
+        exec_reloc r;
+        peek_data(ctx,image+relocs+i*sizeof(r),sizeof(r),&r);
+        exec_patch(space,boot,r.section,r.offset,bases[r.target]);
+    }
+    if (boot) {
+        memmove(boot_program,boot_program+sizeof(h),h.code_size);
+        memset(boot_program+h.code_size,0,boot_program_size-h.code_size);
+        boot_program_size = h.code_size;
+    }
+    return bases[EXEC_SECTION_CODE]+h.entry;
+}
+
 uint32_t* getCPUReg( epu_ctx* ctx, uint8_t reg ) {    
     if (reg == 0)
         return &ctx->ra;
@@ -338,7 +1076,7 @@ uint32_t* getCPUReg( epu_ctx* ctx, uint8_t reg ) {
 
     ctx->flags |= STATUS_BITS_READERR;
 
-    return 0;
+    return &cpu_scratch;
 }
 
 float* getFPUReg( epu_ctx* ctx, uint8_t reg ) {
@@ -353,7 +1091,7 @@ float* getFPUReg( epu_ctx* ctx, uint8_t reg ) {
 
     ctx->flags |= STATUS_BITS_READERR;
 
-    return 0;
+    return &fpu_scratch;
 }
 
 void push( epu_ctx* ctx, uint32_t size, uint32_t* addr, void* data ) {
@@ -361,35 +1099,881 @@ void push( epu_ctx* ctx, uint32_t size, uint32_t* addr, void* data ) {
     *addr += size;
 }
 
-void pop( epu_ctx* ctx, uint32_t size, uint32_t* addr, void* data ) {
-    *addr -= size;
-    peek_data(ctx,*addr,size,data);
+void pop( epu_ctx* ctx, uint32_t size, uint32_t* addr, void* data ) {
+    *addr -= size;
+    peek_data(ctx,*addr,size,data);
+}
+
+/* Returns the events that end the wait of a context */
+uint32_t ctx_events( epu_ctx* ctx ) {
+    uint32_t events = __atomic_load_n(&ctx->events,__ATOMIC_RELAXED) & ctx->wait;
+    if ( ctx->wait & EVENT_BITS_TIMER && ctx->wake <= epu_cycles )
+        events |= EVENT_BITS_TIMER;
+    return events;
+}
+
+/* Returns whether a context can run right now, ending its wait if one of the events it waits on was raised */
+int ctx_runnable( epu_ctx* ctx ) {
+    if (!__atomic_load_n(&ctx->alive,__ATOMIC_ACQUIRE)) // Contexts are spawned by the kernel, which may run on another core
+        return 0;
+    if (ctx->wait) {
+        const uint32_t events = ctx_events(ctx);
+        if (!events)
+            return 0;
+        __atomic_fetch_and(&ctx->events,~events,__ATOMIC_RELAXED);
+        ctx->wait = 0;
+        ctx->wake = 0;
+        ctx->ra = events;
+        return 1;
+    }
+    return ctx->wake <= epu_cycles;
+}
+
+/* Switches to the next context of the core that can run, returns 0 if there are none */
+int schedule() {
+    for (size_t i = 0; i < 256; i += epu_cores) {
+        curr_context += epu_cores;
+        if (ctx_runnable(&contexts[curr_context]))
+            return 1;
+    }
+    return 0;
+}
+
+/* Returns the amount of cycles until a context can run ( 0 if one already can, 0xFFFFFFFF if none will before an event is raised ) */
+uint32_t clock_idle() {
+    uint64_t next = 0;
+    for (size_t i = 0; i < 256; i++) {
+        if (!contexts[i].alive)
+            continue;
+        if (contexts[i].wait) {
+            if (ctx_events(&contexts[i]))
+                return 0;
+            if (!(contexts[i].wait & EVENT_BITS_TIMER))
+                continue;
+        }
+        else if (contexts[i].wake <= epu_cycles)
+            return 0;
+        if (!next || contexts[i].wake < next)
+            next = contexts[i].wake;
+    }
+    if (!next || next-epu_cycles > 0xFFFFFFFF)
+        return 0xFFFFFFFF;
+    return next-epu_cycles;
+}
+
+/* Makes sure a context can run, when every context sleeps time skips to the next wake up ( the host is expected to wait in the meantime, see `clock_idle` ), returns 0 if every context is blocked on events */
+int wake_up() {
+    if (ctx_runnable(&contexts[curr_context]) || schedule())
+        return 1;
+    if (epu_cores > 1) // Other cores may still be running, time skips in `cores_sync` instead
+        return 0;
+    const uint32_t idle = clock_idle();
+    if (idle == 0xFFFFFFFF)
+        return 0;
+    epu_cycles += idle;
+    return schedule();
+}
+
+/* Appends a varint to the replay log, returns 1 if it doesn't fit */
+int replay_put_varint( uint64_t v ) {
+    do {
+        if (replay_pos >= replay_size)
+            return 1;
+        replay_log[replay_pos++] = (v&127)|(v > 127 ? 128 : 0);
+        v >>= 7;
+    } while (v);
+    return 0;
+}
+
+/* Reads a varint from the replay log, returns 1 if it is cut short */
+int replay_get_varint( uint32_t* pos, uint64_t* v ) {
+    *v = 0;
+    for (uint32_t shift = 0; shift < 64; shift += 7) {
+        if (*pos >= replay_size)
+            return 1;
+        const uint8_t b = replay_log[(*pos)++];
+        *v |= (uint64_t)(b&127)<<shift;
+        if (!(b&128))
+            return 0;
+    }
+    return 1;
+}
+
+/* Appends an entry to the replay log, with either a varint or raw data as its payload */
+void replay_put( uint8_t type, uint64_t value, const void* data, uint32_t size ) {
+    const uint32_t start = replay_pos;
+    if (replay_pos >= replay_size) {
+        replay_mode = REPLAY_FULL;
+        return;
+    }
+    replay_log[replay_pos++] = type;
+    if (replay_put_varint(epu_steps-replay_last) || (data ? replay_size-replay_pos < size : replay_put_varint(value))) {
+        replay_pos = start;
+        replay_mode = REPLAY_FULL;
+        return;
+    }
+    if (data) {
+        memcpy(replay_log+replay_pos,data,size);
+        replay_pos += size;
+    }
+    replay_last = epu_steps;
+}
+
+/* Reads the type and instruction count of the next entry of the replay log, returns 0 ( and ends the replay ) if there is none */
+int replay_peek( uint8_t* type, uint64_t* at, uint32_t* payload ) {
+    uint32_t pos = replay_pos;
+    uint64_t steps;
+    if (pos >= replay_size || (*type = replay_log[pos++], replay_get_varint(&pos,&steps))) {
+        replay_mode = REPLAY_END;
+        return 0;
+    }
+    *at = replay_last+steps;
+    *payload = pos;
+    return 1;
+}
+
+/* Consumes the next entry of the replay log if it is of a type and due at the current instruction, returns whether it was */
+int replay_take( uint8_t type, uint64_t* value, void* data, uint32_t size ) {
+    uint8_t t;
+    uint64_t at;
+    uint32_t pos;
+    if (!replay_peek(&t,&at,&pos) || t != type || at != epu_steps)
+        return 0;
+    if (data) {
+        if (replay_size-pos < size) {
+            replay_mode = REPLAY_END;
+            return 0;
+        }
+        memcpy(data,replay_log+pos,size);
+        pos += size;
+    } else if (replay_get_varint(&pos,value)) {
+        replay_mode = REPLAY_END;
+        return 0;
+    }
+    replay_pos = pos;
+    replay_last = at;
+    return 1;
+}
+
+/* Sets the buffer the replay log is written into or read from, starting over at its beginning */
+void replay_buffer( uint8_t* log, uint32_t size ) {
+    replay_log = log;
+    replay_size = size;
+    replay_pos = 0;
+}
+
+/* Starts recording ( REPLAY_RECORD ), replaying ( REPLAY_PLAY ) or stops ( REPLAY_OFF ), instructions are counted from here */
+void replay_start( uint32_t mode ) {
+    if (epu_cores > 1) // Cores interleave in ways a log can't reproduce
+        mode = REPLAY_OFF;
+    replay_mode = mode;
+    replay_pos = 0;
+    replay_last = 0;
+    epu_steps = 0;
+}
+
+/* Returns the state of the recorder ( REPLAY_* ) */
+uint32_t replay_state() {
+    return replay_mode;
+}
+
+/* Returns the amount of bytes of the replay buffer recorded or played back so far */
+uint32_t replay_length() {
+    return replay_pos;
+}
+
+/* Returns a random number from the host, or from the replay log */
+uint32_t host_random() {
+    uint64_t v = 0;
+    if (replay_mode == REPLAY_PLAY) {
+        if (!replay_take(REPLAY_ENTRY_RANDOM,&v,0,0) && replay_mode == REPLAY_PLAY)
+            replay_mode = REPLAY_DESYNC;
+        return v;
+    }
+    v = (uint32_t)ge_random();
+    if (replay_mode == REPLAY_RECORD)
+        replay_put(REPLAY_ENTRY_RANDOM,v,0,0);
+    return v;
+}
+
+/* Raises events ( see EVENT_MASK_HOST ) on every context, waking up the ones waiting on them */
+void raise_events( uint32_t events ) {
+    for (size_t i = 0; i < 256; i++) // Dead contexts too, they are reset when spawned ( and their cores may be reading them )
+        __atomic_fetch_or(&contexts[i].events,events & EVENT_MASK_HOST,__ATOMIC_RELAXED);
+}
+
+/* Raises events from the host ( ignored while replaying, the log provides them ) */
+void epu_event( uint32_t events ) {
+    if (replay_mode == REPLAY_PLAY)
+        return;
+    if (replay_mode == REPLAY_RECORD)
+        replay_put(REPLAY_ENTRY_EVENT,events,0,0);
+    raise_events(events);
+}
+
+/* Returns the address of the input ring the host pushes events into */
+input_ring* input_ring_ptr() {
+    return &epu_input;
+}
+
+/* Applies an input event to the held keys, the pending characters and the mouse */
+void input_apply( const input_event* ev ) {
+    if (ev->type == INPUT_KEY_DOWN || ev->type == INPUT_KEY_UP) {
+        uint32_t* held = ev->key < 32 ? &input_keys.a : &input_keys.b;
+        const uint32_t bit = ev->key < 64 ? 1u<<(ev->key&31) : 0;
+        if (ev->type == INPUT_KEY_UP)
+            *held &= ~bit;
+        else {
+            *held |= bit;
+            if (ev->code && (uint8_t)(input_chars_head-input_chars_tail) < sizeof(input_chars))
+                input_chars[input_chars_head++%sizeof(input_chars)] = ev->code;
+        }
+    }
+    else if (ev->type == INPUT_MOUSE) {
+        mouse_x += ev->dx;
+        mouse_y += ev->dy;
+        mouse_x = mouse_x < 0 ? 0 : mouse_x >= WIDTH ? WIDTH-1 : mouse_x;
+        mouse_y = mouse_y < 0 ? 0 : mouse_y >= HEIGHT ? HEIGHT-1 : mouse_y;
+        mouse_buttons = ev->buttons;
+    }
+}
+
+/* Applies the input events the host pushed since the last call ( or the ones of the replay log ) */
+void input_sync() {
+    if (replay_mode == REPLAY_PLAY) {
+        input_event ev;
+        while (replay_take(REPLAY_ENTRY_INPUT,0,&ev,sizeof(ev)))
+            input_apply(&ev);
+        return;
+    }
+    const uint32_t head = __atomic_load_n(&epu_input.head,__ATOMIC_ACQUIRE);
+    uint32_t tail = epu_input.tail;
+    if (tail == head)
+        return;
+    for (; tail != head; tail++) {
+        const input_event* ev = &epu_input.events[tail&(INPUT_RING_SIZE-1)];
+        input_apply(ev);
+        if (replay_mode == REPLAY_RECORD)
+            replay_put(REPLAY_ENTRY_INPUT,0,ev,sizeof(input_event));
+    }
+    __atomic_store_n(&epu_input.tail,tail,__ATOMIC_RELEASE);
+}
+
+/* Reads a word of the rings of the peripheral bus ( see bus.h ) */
+uint32_t bus_get( uint32_t offset ) {
+    uint32_t v = 0;
+    for (uint32_t i = 0; i < 4; i++)
+        v |= (uint32_t)*mem_read_ptr(bus_ring>>16&255,MEM_SEG_DATA,(bus_ring&0xFFFF)+offset+i) << (i*8);
+    return v;
+}
+
+/* Writes a word of the rings of the peripheral bus */
+void bus_set( uint32_t offset, uint32_t v ) {
+    for (uint32_t i = 0; i < 4; i++)
+        *mem_write_ptr(bus_ring>>16&255,MEM_SEG_DATA,(bus_ring&0xFFFF)+offset+i) = v >> (i*8);
+}
+
+/* Posts the result of a command to the completion ring, returns 1 if it was full */
+int bus_post( uint32_t tag, int32_t result ) {
+    const uint32_t head = bus_get(BUS_DONE_HEAD);
+    if (head-bus_get(BUS_DONE_TAIL) >= BUS_RING_SIZE)
+        return 1;
+    const uint32_t entry = BUS_COMPLETIONS + (head&(BUS_RING_SIZE-1))*sizeof(bus_completion);
+    bus_set(entry,tag);
+    bus_set(entry+4,result);
+    bus_set(BUS_DONE_HEAD,head+1);
+    return 0;
+}
+
+/* Hands the commands queued since the last doorbell to the host in a single call, returns how many completed right away */
+uint32_t bus_doorbell() {
+    if (!bus_ring)
+        return 0;
+    const uint32_t tail = bus_get(BUS_TAIL);
+    const uint32_t queued = bus_get(BUS_HEAD)-tail;
+    const uint32_t count = queued < BUS_RING_SIZE ? queued : BUS_RING_SIZE;
+    if (!count)
+        return 0;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t* words = (uint32_t*)&bus_commands.commands[i];
+        const uint32_t entry = BUS_COMMANDS + ((tail+i)&(BUS_RING_SIZE-1))*sizeof(bus_command);
+        for (uint32_t j = 0; j < sizeof(bus_command)/4; j++)
+            words[j] = bus_get(entry+j*4);
+    }
+    bus_commands.count = count;
+    if (replay_mode == REPLAY_PLAY) {
+        if (!replay_take(REPLAY_ENTRY_BUS,0,bus_commands.results,count*4) && replay_mode == REPLAY_PLAY)
+            replay_mode = REPLAY_DESYNC;
+    }
+    else {
+        for (uint32_t i = 0; i < count; i++)
+            bus_commands.results[i] = BUS_PENDING;
+        epu_call_peripheral(BUS_BATCH,count,0,0,0);
+        if (replay_mode == REPLAY_RECORD)
+            replay_put(REPLAY_ENTRY_BUS,0,bus_commands.results,count*4);
+    }
+    bus_set(BUS_TAIL,tail+count);
+    uint32_t done = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (bus_commands.results[i] != BUS_PENDING && !bus_post(bus_commands.commands[i].tag,bus_commands.results[i]))
+            done++;
+    }
+    return done;
+}
+
+/* Posts the result of a command the host left pending, raising EVENT_BITS_BUS */
+void bus_finish( const bus_completion* done ) {
+    if (bus_ring && !bus_post(done->tag,done->result))
+        raise_events(EVENT_BITS_BUS);
+}
+
+/* Completes a command the host left pending ( ignored while replaying, the log provides them ) */
+void bus_complete( uint32_t tag, int32_t result ) {
+    const bus_completion done = { .tag = tag, .result = result };
+    if (replay_mode == REPLAY_PLAY)
+        return;
+    if (replay_mode == REPLAY_RECORD)
+        replay_put(REPLAY_ENTRY_COMPLETION,0,&done,sizeof(done));
+    bus_finish(&done);
+}
+
+/* Returns the address of the batch the host reads the commands of a doorbell from */
+bus_batch* bus_batch_ptr() {
+    return &bus_commands;
+}
+
+/* Returns the emulated clock rate */
+uint32_t clock_rate() {
+    return CLOCK_HZ;
+}
+
+/* Returns the emulated time in seconds */
+double clock_seconds() {
+    return (double)epu_cycles/CLOCK_HZ;
+}
+
+/* Copies the profiling counters into a buffer if it is big enough, returns their size ( 0 without EPU_PROFILE ) */
+int profile_snapshot(void* dest, int size) {
+#ifdef EPU_PROFILE
+    if (dest && size >= (int)sizeof(profile))
+        memcpy(dest,&epu_profile,sizeof(profile));
+    return sizeof(profile);
+#else
+    (void)dest; (void)size;
+    return 0;
+#endif
+}
+
+/* Clears the profiling counters */
+void profile_reset() {
+#ifdef EPU_PROFILE
+    memset(&epu_profile,0,sizeof(profile));
+    epu_profile.version = PROFILE_VERSION;
+#endif
+}
+
+/* Loads the glyphs of the font */
+void load_font() {
+    for (size_t i = 0; i < ARRSIZE(graphics_font_source)/8; i++) {
+        graphics_chars[i].character = i;
+        for (size_t j = 0; j < 8; j++) {
+            graphics_chars[i].data[7-j] = graphics_font_source[i*8+j];
+        }
+    }
+}
+
+/* Reads a little endian immediate of an instruction */
+uint32_t code_imd( const uint8_t* code, uint32_t size ) {
+    uint32_t v = 0;
+    for (uint32_t i = 0; i < size; i++)
+        v |= (uint32_t)code[i] << (i*8);
+    return v;
+}
+
+/* Returns whether the instruction at an address of the boot program was proven well formed by `verify_boot` */
+int boot_is_verified( uint32_t addr ) {
+    return addr < MEM_SEGMENT_SIZE && (boot_verified[addr>>3]>>(addr&7)&1);
+}
+
+/*
+    Decodes the instruction at an address of the boot program, returns its length if it is well formed ( its operand sizes,
+    forms and registers exist and it fits in the program ), 0 otherwise. `succ` is set to where it can go next: 1 the following
+    instruction, 2 `target`, the address an immediate jump or call leads to in the boot program.
+*/
+uint32_t verify_instruction( uint32_t addr, uint32_t* target, uint8_t* succ ) {
+    const uint32_t avail = boot_program_size - addr;
+    const uint8_t* code = boot_program+addr;
+    if ( avail < 2 )
+        return 0;
+
+    const uint8_t opcode = code[0];
+    const uint8_t opflag = code[1];
+    if ( (opflag&15) > 2 && ( opcode == 1 || opcode == 2 || opcode == 4 || opcode == 5 || opcode == 7 || opcode == 9 || opcode == 10 || opcode == 11 ) )
+        return 0;
+
+    const uint32_t tz = 1<<(opflag&15);
+    const uint32_t iz = opflag&32 ? 1u<<(opflag>>6) : tz;
+    uint32_t len = 2;
+    uint32_t dest = 0;
+    *succ = 1;
+
+    if (opcode == 0 || opcode == 8) // HLT, RET
+        *succ = 0;
+
+    else if (opcode == 1) { // ALU
+        if ( (opflag&16) && iz > 4 )
+            return 0;
+        len = 4 + (opflag&16 ? iz : 0);
+    }
+
+    else if (opcode == 2) { // MOV
+        if ( avail < 3 )
+            return 0;
+        const uint8_t i = code[2]>>4;
+        const uint8_t o = code[2]&15;
+        if ( i > 3 || o > 2 || ( (i == 1 || i == 2) && ( o == 1 || o == 2 ) ) || ( i == 3 && iz > 4 ) )
+            return 0;
+        len = 3 + (i < 2 ? 1 : i == 2 ? 4 : iz);
+        len += o == 2 ? 4 : o == 1 ? (i == 0 ? 0 : 1) : (i < 2 ? 0 : 1);
+    }
+
+    else if (opcode == 3) { // FPU
+        if ( avail < 3 )
+            return 0;
+        const uint8_t io = code[2];
+        const uint8_t mode = opflag&7;
+        if ( mode > 2 || ( mode != 1 && (io&15) > 3 ) || ( mode != 0 && (io>>4) > 3 ) )
+            return 0;
+        len = 3;
+    }
+
+    else if (opcode == 4 || opcode == 7) { // JMP, CAL
+        if ( avail < 4 )
+            return 0;
+        const uint8_t src = code[2]&15;
+        const uint8_t cond = code[3];
+        if ( src > 3 || ( opcode == 4 && (cond&0xE0) ) )
+            return 0;
+        len = (opcode == 4 ? 4 : 3) + (src == 2 ? 4 : src == 3 ? tz : 0);
+        if ( src == 3 && len <= avail ) {
+            const uint32_t base = 0xFF000000|addr;
+            const uint32_t off = code_imd(code+len-tz,tz);
+            if (opcode == 4)
+                dest = (opflag&16 ? 0 : base) + (opflag&32 ? -off : off);
+            else
+                dest = opflag&16 ? base + (opflag&32 ? -off : off) : off;
+            if ( (dest>>24) == 0xFF )
+                *succ |= 2;
+        }
+        if ( opcode == 4 && (cond&15) == 0 ) // Never ( `cmp & 0 != 0` ) or always ( `cmp & 0 == 0` ) taken
+            *succ = cond&0x10 ? *succ&2 : 1;
+    }
+
+    else if (opcode == 5) { // CMP
+        if ( avail < 3 )
+            return 0;
+        const uint8_t a_kind = code[2]>>4;
+        const uint8_t b_kind = code[2]&15;
+        if ( a_kind > 3 || b_kind > 3 || ( (a_kind == 1 || a_kind == 2) && ( b_kind == 1 || b_kind == 2 ) ) )
+            return 0;
+        len = 3 + (a_kind < 2 ? 1 : a_kind == 2 ? 4 : tz);
+        len += b_kind < 2 ? (a_kind < 2 ? 0 : 1) : b_kind == 2 ? 4 : tz;
+    }
+
+    else if (opcode == 6) // INT
+        len = 6;
+
+    else if (opcode == 9) { // ATOM
+        if ( avail < 3 || code[2] > 3 )
+            return 0;
+        len = 4;
+    }
+
+    else if (opcode == 10 || opcode == 11) // PUSH, POP
+        len = 4;
+
+    else
+        return 0;
+
+    if ( len > avail )
+        return 0;
+    *target = dest&0xFFFFFF;
+    return len;
+}
+
+/*
+    Proves the instruction boundaries of the boot program: walks the code reachable from its entry point ( and from where the
+    contexts are ) through fallthroughs and immediate jumps and calls, marking each well formed instruction in `boot_verified`.
+    Code only reached through computed jumps stays unmarked, so that it runs through the checked path of `loop`.
+*/
+void verify_boot() {
+    memset(boot_verified,0,sizeof(boot_verified));
+
+    uint32_t top = 0;
+    verify_stack[top++] = 0;
+    for (size_t i = 0; i < 256; i++) {
+        if (contexts[i].alive && (contexts[i].pc>>24) == 0xFF && top < VERIFY_STACK_SIZE)
+            verify_stack[top++] = contexts[i].pc&0xFFFFFF;
+    }
+
+    while (top) {
+        const uint32_t addr = verify_stack[--top];
+        if ( addr >= (uint32_t)boot_program_size || boot_is_verified(addr) )
+            continue;
+        uint32_t target;
+        uint8_t succ;
+        const uint32_t len = verify_instruction(addr,&target,&succ);
+        if ( !len )
+            continue;
+        boot_verified[addr>>3] |= 1<<(addr&7);
+        if ( (succ&1) && top < VERIFY_STACK_SIZE ) // Whatever doesn't fit stays unverified
+            verify_stack[top++] = addr+len;
+        if ( (succ&2) && top < VERIFY_STACK_SIZE )
+            verify_stack[top++] = target;
+    }
+}
+
+/* Returns the size of a snapshot, counting its records into the header */
+uint32_t snapshot_size( snapshot_header* header ) {
+    for (size_t i = 0; i < 256; i++) {
+        if (contexts[i].alive)
+            header->contexts++;
+        for (uint8_t seg = 0; seg < 3; seg++) {
+            for (uint8_t page = 0; page < MEM_PAGE_COUNT; page++) {
+                const uint8_t owner = proc_pages[i].owner[seg][page];
+                if (owner != i || proc_pages[i].shared[seg][page])
+                    header->mappings++;
+                if (owner == i && proc_pages[i].gen[seg][page] > header->base)
+                    header->pages++;
+            }
+        }
+    }
+    return sizeof(snapshot_header) + SNAPSHOT_VIDEO_SIZE(WIDTH,HEIGHT) + header->boot_size
+        + header->contexts*header->ctx_size
+        + header->mappings*sizeof(snapshot_mapping)
+        + header->pages*(sizeof(snapshot_page)+MEM_PAGE_SIZE);
+}
+
+/* Writes a snapshot of the machine into a buffer if it is big enough, returns its size ( `base` is the generation of the snapshot to only write the changes against, 0 for a full snapshot ) */
+int epu_snapshot( void* dest, int size, uint32_t base ) {
+    snapshot_header header = {
+        .magic = SNAPSHOT_MAGIC,
+        .version = SNAPSHOT_VERSION,
+        .ctx_size = 4+sizeof(epu_ctx),
+        .base = base,
+        .gen = mem_gen,
+        .boot_size = base ? 0 : boot_program_size,
+        .cycles_lo = epu_cycles,
+        .cycles_hi = epu_cycles>>32,
+        .curr_context = curr_context,
+        .video_mode = video_mode,
+        .bus_ring = bus_ring,
+    };
+    header.size = snapshot_size(&header);
+    if (!dest || size < (int)header.size)
+        return header.size;
+
+    uint8_t* p = dest;
+    memcpy(p,&header,sizeof(header)); p += sizeof(header);
+    memcpy(p,graphics_palette,sizeof(graphics_palette)); p += sizeof(graphics_palette);
+    memcpy(p,screen,sizeof(screen)); p += sizeof(screen);
+    memcpy(p,screen_indices,sizeof(screen_indices)); p += sizeof(screen_indices);
+    memcpy(p,text_cells,sizeof(text_cells)); p += sizeof(text_cells);
+    memcpy(p,text_drawn,sizeof(text_drawn)); p += sizeof(text_drawn);
+    memcpy(p,sprites,sizeof(sprites)); p += sizeof(sprites);
+    memcpy(p,boot_program,header.boot_size); p += header.boot_size;
+
+    for (uint32_t i = 0; i < 256; i++) if (contexts[i].alive) {
+        memcpy(p,&i,4);
+        memcpy(p+4,&contexts[i],sizeof(epu_ctx));
+        p += header.ctx_size;
+    }
+    for (size_t i = 0; i < 256; i++) {
+        for (uint8_t seg = 0; seg < 3; seg++) {
+            for (uint8_t page = 0; page < MEM_PAGE_COUNT; page++) {
+                const snapshot_mapping map = {
+                    .space = i, .seg = seg, .page = page,
+                    .owner = proc_pages[i].owner[seg][page],
+                    .shared = proc_pages[i].shared[seg][page],
+                };
+                if (map.owner != i || map.shared) {
+                    memcpy(p,&map,sizeof(map));
+                    p += sizeof(map);
+                }
+            }
+        }
+    }
+    for (size_t i = 0; i < 256; i++) {
+        for (uint8_t seg = 0; seg < 3; seg++) {
+            for (uint8_t page = 0; page < MEM_PAGE_COUNT; page++) {
+                if (proc_pages[i].owner[seg][page] != i || proc_pages[i].gen[seg][page] <= base)
+                    continue;
+                const snapshot_page pg = { .space = i, .seg = seg, .page = page };
+                memcpy(p,&pg,sizeof(pg));
+                memcpy(p+sizeof(pg),mem_segment(i,seg)+page*MEM_PAGE_SIZE,MEM_PAGE_SIZE);
+                p += sizeof(pg)+MEM_PAGE_SIZE;
+            }
+        }
+    }
+
+    snapshot_gen = mem_gen++;
+    return header.size;
+}
+
+/* Restores the machine from a snapshot ( a delta only applies right after restoring or taking its base ), returns 0 on success, 1 for a malformed snapshot and 2 if the machine isn't in the state the delta is based on */
+int epu_restore( const void* src, int size ) {
+    const uint8_t* p = src;
+    snapshot_header header;
+    if (size < (int)sizeof(header))
+        return 1;
+    memcpy(&header,p,sizeof(header));
+    if (header.magic != SNAPSHOT_MAGIC || header.version != SNAPSHOT_VERSION || header.ctx_size != 4+sizeof(epu_ctx) || header.size != (uint32_t)size)
+        return 1;
+    if (header.contexts > 256 || header.mappings > 256*3*MEM_PAGE_COUNT || header.pages > 256*3*MEM_PAGE_COUNT || header.boot_size > MEM_SEGMENT_SIZE)
+        return 1;
+    if (header.curr_context > 255 || (header.base && header.boot_size) || header.video_mode > VIDEO_MODE_INDEXED || (header.bus_ring && (header.bus_ring>>24 != 1 || (header.bus_ring&0xFFFF)+BUS_RING_BYTES > 65536)))
+        return 1;
+    if (header.size != sizeof(snapshot_header) + SNAPSHOT_VIDEO_SIZE(WIDTH,HEIGHT) + header.boot_size
+        + header.contexts*header.ctx_size
+        + header.mappings*sizeof(snapshot_mapping)
+        + header.pages*(sizeof(snapshot_page)+MEM_PAGE_SIZE))
+        return 1;
+
+    const uint8_t* records = p + sizeof(header) + SNAPSHOT_VIDEO_SIZE(WIDTH,HEIGHT) + header.boot_size;
+    const uint8_t* maps = records + header.contexts*header.ctx_size;
+    const uint8_t* pages = maps + header.mappings*sizeof(snapshot_mapping);
+
+    // Validates every record before touching anything
+    for (uint32_t i = 0; i < header.contexts; i++) {
+        uint32_t id;
+        memcpy(&id,records+i*header.ctx_size,4);
+        if (id > 255)
+            return 1;
+    }
+    for (uint32_t i = 0; i < header.mappings; i++) {
+        snapshot_mapping map;
+        memcpy(&map,maps+i*sizeof(map),sizeof(map));
+        if (map.seg >= 3 || map.page >= MEM_PAGE_COUNT)
+            return 1;
+    }
+    for (uint32_t i = 0; i < header.pages; i++) {
+        snapshot_page pg;
+        memcpy(&pg,pages+i*(sizeof(pg)+MEM_PAGE_SIZE),sizeof(pg));
+        if (pg.seg >= 3 || pg.page >= MEM_PAGE_COUNT)
+            return 1;
+    }
+
+    if (header.base) {
+        if (header.base != snapshot_gen)
+            return 2;
+        for (size_t i = 0; i < 256; i++) {
+            for (uint8_t seg = 0; seg < 3; seg++) {
+                for (uint8_t page = 0; page < MEM_PAGE_COUNT; page++) {
+                    if (proc_pages[i].gen[seg][page] > header.base)
+                        return 2;
+                }
+            }
+        }
+    } else {
+        // Only the pages that were ever written can hold anything
+        for (size_t i = 0; i < 256; i++) {
+            for (uint8_t seg = 0; seg < 3; seg++) {
+                for (uint8_t page = 0; page < MEM_PAGE_COUNT; page++) {
+                    if (!proc_pages[i].gen[seg][page])
+                        continue;
+                    memset(mem_segment(i,seg)+page*MEM_PAGE_SIZE,0,MEM_PAGE_SIZE);
+                    proc_pages[i].gen[seg][page] = 0;
+                }
+            }
+        }
+        if ((uint32_t)boot_program_size > header.boot_size)
+            memset(boot_program+header.boot_size,0,boot_program_size-header.boot_size);
+        memcpy(boot_program,p+sizeof(header)+SNAPSHOT_VIDEO_SIZE(WIDTH,HEIGHT),header.boot_size);
+        boot_program_size = header.boot_size;
+    }
+
+    p += sizeof(header);
+    memcpy(graphics_palette,p,sizeof(graphics_palette)); p += sizeof(graphics_palette);
+    memcpy(screen,p,sizeof(screen)); p += sizeof(screen);
+    memcpy(screen_indices,p,sizeof(screen_indices)); p += sizeof(screen_indices);
+    memcpy(text_cells,p,sizeof(text_cells)); p += sizeof(text_cells);
+    memcpy(text_drawn,p,sizeof(text_drawn)); p += sizeof(text_drawn);
+    memcpy(sprites,p,sizeof(sprites));
+    memcpy(sprites_drawn,sprites,sizeof(sprites));
+    memset(sprites_dirty,0,sizeof(sprites_dirty));
+    video_mode = header.video_mode;
+    bus_ring = header.bus_ring;
+
+    memset(contexts,0,256*sizeof(epu_ctx));
+    for (uint32_t i = 0; i < header.contexts; i++) {
+        uint32_t id;
+        memcpy(&id,records+i*header.ctx_size,4);
+        memcpy(&contexts[id],records+i*header.ctx_size+4,sizeof(epu_ctx));
+    }
+
+    for (size_t i = 0; i < 256; i++) {
+        memset(proc_pages[i].owner,i,sizeof(proc_pages[i].owner));
+        memset(proc_pages[i].shared,0,sizeof(proc_pages[i].shared));
+    }
+    for (uint32_t i = 0; i < header.mappings; i++) {
+        snapshot_mapping map;
+        memcpy(&map,maps+i*sizeof(map),sizeof(map));
+        proc_pages[map.space].owner[map.seg][map.page] = map.owner;
+        proc_pages[map.space].shared[map.seg][map.page] = map.shared;
+    }
+    for (uint32_t i = 0; i < header.pages; i++) {
+        const uint8_t* rec = pages+i*(sizeof(snapshot_page)+MEM_PAGE_SIZE);
+        snapshot_page pg;
+        memcpy(&pg,rec,sizeof(pg));
+        memcpy(mem_segment(pg.space,pg.seg)+pg.page*MEM_PAGE_SIZE,rec+sizeof(pg),MEM_PAGE_SIZE);
+        proc_pages[pg.space].gen[pg.seg][pg.page] = header.gen;
+    }
+
+    verify_boot();
+
+    epu_cycles = ((uint64_t)header.cycles_hi<<32)|header.cycles_lo;
+    curr_context = header.curr_context;
+    snapshot_gen = header.gen;
+    mem_gen = header.gen+1;
+
+    input_keys = (keys){ .a = 0, .b = 0 };
+    input_chars_head = input_chars_tail = 0;
+
+    load_font();
+    ge_screen_size(WIDTH,HEIGHT);
+    video_touch(0,HEIGHT);
+    send_video();
+
+    return 0;
+}
+
+/* Decompresses an LZ4 block into exactly `size` bytes, returns 1 if it is malformed */
+int lz4_decode( uint8_t* dst, uint32_t size, const uint8_t* src, uint32_t src_size ) {
+    uint32_t i = 0;
+    uint32_t o = 0;
+    while (i < src_size) {
+        const uint8_t token = src[i++];
+        uint32_t n = token>>4;
+        if (n == 15) {
+            uint8_t b;
+            do {
+                if (i >= src_size)
+                    return 1;
+                n += b = src[i++];
+            } while (b == 255);
+        }
+        if (n > src_size-i || n > size-o)
+            return 1;
+        memcpy(dst+o,src+i,n);
+        i += n;
+        o += n;
+        if (i == src_size) // The last sequence only has literals
+            break;
+        if (src_size-i < 2)
+            return 1;
+        const uint32_t offset = src[i] | src[i+1]<<8;
+        i += 2;
+        if (!offset || offset > o)
+            return 1;
+        n = (token&15)+4;
+        if ((token&15) == 15) {
+            uint8_t b;
+            do {
+                if (i >= src_size)
+                    return 1;
+                n += b = src[i++];
+            } while (b == 255);
+        }
+        if (n > size-o)
+            return 1;
+        for (uint32_t j = 0; j < n; j++, o++) // Byte by byte, matches can overlap what they copy
+            dst[o] = dst[o-offset];
+    }
+    return o != size;
+}
+
+/* Decompresses the chunks of the compressed image a range of a disk covers, returns 1 if one of them is malformed */
+int disk_load( fat_disk* disk, uint32_t addr, uint32_t size ) {
+    if (!size)
+        return 0;
+    const size_t last = (addr+size-1)/disk_info.chunk_size;
+    for (size_t i = addr/disk_info.chunk_size; i <= last && i < disk_info.chunks; i++) {
+        if (disk_loaded[i])
+            continue;
+        disk_chunk chunk;
+        memcpy(&chunk,disk_image+sizeof(disk_header)+i*sizeof(disk_chunk),sizeof(chunk));
+        const uint32_t start = i*disk_info.chunk_size;
+        const uint32_t len = disk_info.size-start < disk_info.chunk_size ? disk_info.size-start : disk_info.chunk_size;
+        if (!chunk.size)
+            memset(disk->data+start,0,len);
+        else if (chunk.size == len)
+            memcpy(disk->data+start,disk_image+chunk.offset,len);
+        else if (lz4_decode(disk->data+start,len,disk_image+chunk.offset,chunk.size))
+            return 1;
+        disk_loaded[i] = 1;
+    }
+    return 0;
+}
+
+/*
+    Sets up a disk to read an image: raw images are read in place, compressed ones ( see disk.h ) are decompressed into
+    `boot_floppy_data` as they are read. Returns 1 if the header or the chunk index of a compressed image is malformed.
+*/
+int disk_mount( fat_disk* disk, uint8_t* image, uint32_t size ) {
+    if (size < sizeof(disk_header) || fat_u32(image) != DISK_MAGIC) {
+        disk->data = image;
+        disk->size = size;
+        disk->load = 0;
+        return 0;
+    }
+    if (image == boot_floppy_data) // Its chunks would overwrite it
+        return 1;
+    memcpy(&disk_info,image,sizeof(disk_info));
+    const uint32_t cs = disk_info.chunk_size;
+    if (disk_info.version != DISK_VERSION || disk_info.size > BOOT_FLOPPY_SIZE || cs < 512 || cs > 65536 || (cs & (cs-1)))
+        return 1;
+    if (disk_info.chunks != (disk_info.size+cs-1)/cs || disk_info.chunks > (size-sizeof(disk_header))/sizeof(disk_chunk))
+        return 1;
+    for (uint32_t i = 0; i < disk_info.chunks; i++) {
+        disk_chunk chunk;
+        memcpy(&chunk,image+sizeof(disk_header)+i*sizeof(disk_chunk),sizeof(chunk));
+        if (chunk.offset > size || chunk.size > size-chunk.offset || chunk.size > cs)
+            return 1;
+    }
+    disk_image = image;
+    memset(disk_loaded,0,sizeof(disk_loaded));
+    disk->data = boot_floppy_data;
+    disk->size = disk_info.size;
+    disk->load = disk_load;
+    return 0;
 }
 
 int init() {
     ge_screen_size(WIDTH,HEIGHT);
+    video_touch(0,HEIGHT);
     blit_image(&boot_logo,0,0);
     send_video();
     
     /// Loads The Boot Code ///
 
     epu_load_floppy(0,0,&boot_floppy_size);
-    if (boot_floppy_size != BOOT_FLOPPY_SIZE) {
+    uint8_t* const image = boot_floppy_size == BOOT_FLOPPY_SIZE ? boot_floppy_data : boot_floppy_packed; // Anything smaller has to be compressed
+    if (boot_floppy_size <= 0 || boot_floppy_size > BOOT_FLOPPY_SIZE) {
         blit_image(&floppy_logo,21,3);
         send_video();
         return 1;
-    } else if (!epu_load_floppy(0,boot_floppy_data,0)) {
+    } else if (!epu_load_floppy(0,image,0)) {
         blit_image(&floppy_bad_logo,21,3);
         send_video();
         return 1;
     }
 
     boot_floppy = (fat_disk){
-        .data = boot_floppy_data
+        .boot = &boot_floppy_sector,
     };
-    fat_read_boot_sector(&boot_floppy);
 
-    if (fat_boot_file(&boot_floppy,boot_program,&boot_program_size)) {
+    if (disk_mount(&boot_floppy,image,boot_floppy_size) || (boot_floppy.size != BOOT_FLOPPY_SIZE && !boot_floppy.load)
+        || fat_read_boot_sector(&boot_floppy) || fat_boot_file(&boot_floppy,boot_program,&boot_program_size,sizeof(boot_program))) {
         blit_image(&floppy_corr_logo,21,3);
         send_video();
         return 1;
@@ -399,6 +1983,14 @@ int init() {
 
     memset(contexts,0,256*sizeof(epu_ctx));
     memset(proc_memory,0,256*sizeof(ctx_memory));
+    memset(proc_pages,0,256*sizeof(ctx_pages));
+
+    for (size_t i = 0; i < 256; i++) {
+        memset(proc_pages[i].owner,i,sizeof(proc_pages[i].owner));
+    }
+
+    mem_gen = 1;
+    snapshot_gen = 0;
 
     contexts[0] = (epu_ctx){
         .alive = 1,
@@ -428,30 +2020,337 @@ int init() {
     // Copy Boot Code into the kernel's code space ( not necessary )
     // memcpy(&proc_memory[0].code,boot_program,(size_t)boot_program_size<sizeof(proc_memory[0].code)?(size_t)boot_program_size:sizeof(proc_memory[0].code));
 
+    if (boot_program_size >= (int)sizeof(exec_header) && fat_u32(boot_program) == EXEC_MAGIC) { // An executable rather than raw code, its data and ropd go to the kernel's space
+        contexts[0].pc = exec_load(&contexts[0],0xFF000000,boot_program_size,0,1);
+        if (!contexts[0].pc) {
+            blit_image(&floppy_corr_logo,21,3);
+            send_video();
+            return 1;
+        }
+    }
+
+    verify_boot();
+
     curr_context = 0;
+    epu_cycles = 0;
 
-    /// Loads The Font ///
+    input_keys = (keys){ .a = 0, .b = 0 };
+    input_chars_head = input_chars_tail = 0;
 
-    for (size_t i = 0; i < ARRSIZE(graphics_font_source)/8; i++) {
-        graphics_chars[i].character = i;
-        for (size_t j = 0; j < 8; j++) {
-            graphics_chars[i].data[7-j] = graphics_font_source[i*8+j];
+    video_mode = VIDEO_MODE_DIRECT;
+    bus_ring = 0;
+    memset(screen_indices,0,sizeof(screen_indices));
+    memset(text_cells,0,sizeof(text_cells));
+    memset(text_drawn,0,sizeof(text_drawn));
+    memset(sprites,0,sizeof(sprites));
+    memset(sprites_drawn,0,sizeof(sprites_drawn));
+    memset(sprites_dirty,0,sizeof(sprites_dirty));
+
+    load_font();
+
+    return 0;
+}
+
+/* Applies an ALU operation to a register */
+void alu_apply( uint8_t op, uint32_t* a, uint32_t b, uint32_t sz ) {
+         if (op == 0x00) *a = ((*a) + b)  & sz;
+    else if (op == 0x01) *a = ((*a) - b)  & sz;
+    else if (op == 0x02) *a = ((*a) * b)  & sz;
+    else if (op == 0x03) *a = ((*a) / b)  & sz;
+    else if (op == 0x04) *a = ((*a) & b)  & sz;
+    else if (op == 0x05) *a = ((*a) | b)  & sz;
+    else if (op == 0x06) *a = ((*a) ^ b)  & sz;
+    else if (op == 0x07) *a = ((*a) << (b&31)) & sz; // Shift amounts wrap, like on wasm
+    else if (op == 0x08) *a = ((*a) >> (b&31)) & sz;
+    else if (op == 0x09) *a = ((*a) % b)  & sz;
+}
+
+/*
+    Runs an atomic operation ( 0: fetch and add, 1: exchange, 2: compare and swap against `expected` ) on a naturally aligned
+    value of `size` bytes, returns the value it held before.
+*/
+uint32_t atom_apply( uint8_t op, uint8_t* p, uint32_t size, uint32_t v, uint32_t expected ) {
+    if (size == 1) {
+        uint8_t e = expected;
+        if (op == 0x00) return __atomic_fetch_add(p,(uint8_t)v,__ATOMIC_SEQ_CST);
+        if (op == 0x01) return __atomic_exchange_n(p,(uint8_t)v,__ATOMIC_SEQ_CST);
+        __atomic_compare_exchange_n(p,&e,(uint8_t)v,0,__ATOMIC_SEQ_CST,__ATOMIC_SEQ_CST);
+        return e;
+    }
+    if (size == 2) {
+        uint16_t* q = (uint16_t*)p;
+        uint16_t e = expected;
+        if (op == 0x00) return __atomic_fetch_add(q,(uint16_t)v,__ATOMIC_SEQ_CST);
+        if (op == 0x01) return __atomic_exchange_n(q,(uint16_t)v,__ATOMIC_SEQ_CST);
+        __atomic_compare_exchange_n(q,&e,(uint16_t)v,0,__ATOMIC_SEQ_CST,__ATOMIC_SEQ_CST);
+        return e;
+    }
+    uint32_t* q = (uint32_t*)p;
+    uint32_t e = expected;
+    if (op == 0x00) return __atomic_fetch_add(q,v,__ATOMIC_SEQ_CST);
+    if (op == 0x01) return __atomic_exchange_n(q,v,__ATOMIC_SEQ_CST);
+    __atomic_compare_exchange_n(q,&e,v,0,__ATOMIC_SEQ_CST,__ATOMIC_SEQ_CST);
+    return e;
+}
+
+/* Updates the compare status of a context with the comparison of two operands */
+void cmp_apply( epu_ctx* context, uint8_t opflag, uint32_t a, uint32_t b ) {
+    const uint32_t sz = SZ2MASK(opflag&15);
+
+    a &= sz;
+    b &= sz;
+
+    if ( !( opflag & 32 ) ) // Clear Compare Status
+        context->cmp = 0;
+
+    if ( opflag & 16 ) { // Signed Compare
+        int32_t sa = (opflag&15)==0 ? *(int8_t*)&a : (opflag&15)==1 ? *(int16_t*)&a : (opflag&15)==2 ? *(int32_t*)&a : 0;
+        int32_t sb = (opflag&15)==0 ? *(int8_t*)&b : (opflag&15)==1 ? *(int16_t*)&b : (opflag&15)==2 ? *(int32_t*)&b : 0;
+        if ( sa == sb )
+            context->cmp |= CMP_BITS_EQ;
+        if ( sa < sb )
+            context->cmp |= CMP_BITS_LT;
+        if ( sa > sb )
+            context->cmp |= CMP_BITS_GT;
+    } else { // Unsigned Compare
+        if ( a == b )
+            context->cmp |= CMP_BITS_EQ;
+        if ( a < b )
+            context->cmp |= CMP_BITS_LT;
+        if ( a > b )
+            context->cmp |= CMP_BITS_GT;
+    }
+}
+
+/* Takes a conditional jump of a context, `base` being the address of the instruction */
+void jmp_apply( epu_ctx* context, uint8_t opflag, uint8_t cond, uint32_t base, uint32_t addr_off ) {
+    uint32_t addr = (opflag&16 ? 0 : base) + (opflag&32 ? -addr_off : addr_off);
+
+    if ( (cond & 0xF0) == 0x00 ) {
+        if ( (context->cmp & (cond&0x0F)) != 0 )
+            context->pc = addr;
+    }
+
+    else if ( (cond & 0xF0) == 0x10 ) {
+        if ( (context->cmp & (cond&0x0F)) == 0 )
+            context->pc = addr;
+    }
+
+    else
+        context->flags |= STATUS_BITS_ILLINST;
+}
+
+#ifdef EPU_PROFILE
+/* Counts an instruction starting at `pc` in the profile */
+void profile_instruction( epu_ctx* context, uint8_t opcode, uint8_t opflag, uint32_t pc ) {
+    epu_profile.ops[opcode][opflag]++;
+    if (++epu_profile.instructions % PROFILE_PC_PERIOD == 0)
+        epu_profile.pcs[context->s&255][(pc&0xFFFF)>>PROFILE_PC_SHIFT]++;
+}
+#endif
+
+/*
+    Runs the instruction at `code` ( the program counter ) if it has one of the simple forms fusion handles, returns its length
+    or 0 when it has to go through `loop` instead ( also when it doesn't fit in the `avail` bytes left ), in which case nothing
+    happened.
+    The simple forms are MOVs into registers, ALU operations and CMPs, with register and immediate operands, and jumps to an
+    immediate, which can't fault or touch memory, so that their effects only depend on the registers.
+    Unless `checked`, the instruction was proven well formed by `verify_boot` and its encoding isn't checked again.
+*/
+uint32_t fused_step( epu_ctx* context, const uint8_t* code, uint32_t avail, int checked ) {
+    if ( checked && avail < 4 )
+        return 0;
+
+    const uint8_t opcode = code[0];
+    const uint8_t opflag = code[1];
+
+    if ( (opflag&15) > 2 ) // Also leaves out the opcodes fusion doesn't handle, which may not have operand sizes
+        return 0;
+
+    const uint32_t sz = SZ2MASK(opflag&15);
+    const uint32_t tz = 1<<(opflag&15);
+
+    if (opcode == 1) { // ALU
+        const uint8_t op = code[2];
+        const uint8_t io = code[3];
+        uint32_t len = 4;
+        uint32_t b;
+        if ( opflag&16 ) { // Imd
+            const uint32_t iz = opflag&32 ? 1u<<(opflag>>6) : tz;
+            if ( checked && ( iz > 4 || avail < len+iz ) )
+                return 0;
+            b = code_imd(code+len,iz);
+            len += iz;
+        }
+        else // Reg
+            b = (*getCPUReg(context,io>>4)) & sz;
+        if ( (op == 0x03 || op == 0x09) && b == 0 )
+            return 0;
+        alu_apply(op,getCPUReg(context,io&15),b,sz);
+        context->pc += len;
+        return len;
+    }
+
+    if (opcode == 2) { // MOV into a register
+        const uint8_t i = code[2]>>4;
+        const uint8_t o = code[2]&15;
+        if ( o != 0 )
+            return 0;
+        if ( i == 0 ) { // Reg
+            const uint8_t p = code[3];
+            *getCPUReg(context,p>>4) = *getCPUReg(context,p&15) & sz;
+            context->pc += 4;
+            return 4;
+        }
+        if ( i == 3 ) { // Imd
+            const uint32_t iz = opflag&32 ? 1u<<(opflag>>6) : tz;
+            if ( checked && ( iz > 4 || avail < 3+iz+1 ) )
+                return 0;
+            *getCPUReg(context,code[3+iz]&15) = code_imd(code+3,iz);
+            context->pc += 3+iz+1;
+            return 3+iz+1;
+        }
+        return 0;
+    }
+
+    if (opcode == 4) { // JMP to an immediate
+        const uint8_t src = code[2];
+        const uint8_t cond = code[3];
+        if ( (src&15) != 3 || ( checked && ( (cond&0xE0) != 0 || avail < 4+tz ) ) )
+            return 0;
+        const uint32_t base = context->pc;
+        context->pc += 4+tz;
+        jmp_apply(context,opflag,cond,base,code_imd(code+4,tz));
+        return 4+tz;
+    }
+
+    if (opcode == 5) { // CMP
+        const uint8_t a_kind = code[2]>>4;
+        const uint8_t b_kind = code[2]&15;
+        if ( (a_kind != 0 && a_kind != 3) || (b_kind != 0 && b_kind != 3) )
+            return 0;
+        uint32_t len = 3;
+        uint32_t a;
+        uint32_t b;
+        uint8_t p = 0;
+        if ( checked && avail < len + (a_kind ? tz : 1) )
+            return 0;
+        if ( a_kind == 0 ) { // Reg
+            p = code[len++];
+            a = *getCPUReg(context,p&15);
+        } else { // Imd
+            a = code_imd(code+len,tz);
+            len += tz;
         }
+        if ( b_kind == 0 ) { // Reg
+            if ( a_kind == 3 ) {
+                if ( checked && avail < len+1 )
+                    return 0;
+                p = code[len++];
+            } else
+                p >>= 4;
+            b = *getCPUReg(context,p&15);
+        } else { // Imd
+            if ( checked && avail < len+tz )
+                return 0;
+            b = code_imd(code+len,tz);
+            len += tz;
+        }
+        cmp_apply(context,opflag,a,b);
+        context->pc += len;
+        return len;
     }
 
     return 0;
 }
 
-int loop(size_t steps) { for (size_t it = 0; it < steps; it++) {
+/*
+    Superinstructions: runs the simple instructions ( see `fused_step` ) found at the program counter straight from the code
+    page, at most `budget` of them and up to the first jump, without fetching them through `read_data` and dispatching each
+    one in `loop`. Idioms like `cmp` + `jxx`, `mov` + `add` or a few `mov`s before an `int` then take a single dispatch.
+    In the verified boot code ( see `verify_boot` ) the instructions skip their checks and runs go on through the jumps that
+    land on verified code, so that whole loops take a single dispatch.
+    All but the last instruction of the run are accounted for like `loop` does, which accounts for the last one itself
+    ( its opcode is stored in `last` ). Returns the amount of instructions that ran.
+*/
+uint32_t fuse( epu_ctx* context, uint32_t budget, uint8_t* last ) {
+    uint8_t space, seg;
+    const int region = mem_region(context,context->pc,0,&space,&seg);
+    if ( region != 1 && region != 2 )
+        return 0;
+
+    const uint8_t* code = region == 2 ? boot_program+(context->pc&0xFFFFFF) : mem_read_ptr(space,seg,context->pc);
+
+    uint32_t count = 0;
+    while ( count < budget ) {
+        const uint8_t opcode = code[0];
+        const uint32_t pc = context->pc;
+        const uint32_t avail = MEM_PAGE_SIZE-1 - (pc&(MEM_PAGE_SIZE-1)); // Checked runs stop short of the end of the page, where `read_data` may wrap the program counter around
+        const int checked = region != 2 || !boot_is_verified(pc&0xFFFFFF);
+        const uint32_t len = fused_step(context,code,avail,checked);
+        if ( !len )
+            break;
+        if ( count ) { // The previous instruction ends here
+            epu_cycles += 1 + cycle_costs[*last];
+            epu_steps++;
+            context->c++;
+#ifdef EPU_PROFILE
+            epu_profile.fused++;
+#endif
+        }
+#ifdef EPU_PROFILE
+        profile_instruction(context,opcode,code[1],pc);
+#endif
+        instruction = opcode | code[1]<<8; // Left as the last instruction fetched, like `read_data` does
+        *last = opcode;
+        count++;
+        if ( opcode == 4 ) {
+            if ( checked || (context->pc>>24) != 0xFF || !boot_is_verified(context->pc&0xFFFFFF) )
+                break;
+            code = boot_program+(context->pc&0xFFFFFF);
+            continue;
+        }
+        code += len;
+    }
+    return count;
+}
+
+int loop(uint32_t steps) { if ( !wake_up() ) return 0; for (size_t it = 0; it < steps; it++) {
     epu_ctx* context = &contexts[curr_context];
 
-    read_data(context,&context->pc,2,&instruction);
+    uint8_t opcode;
+    uint8_t opflag;
+
+#ifndef EPU_NO_FUSION
+    { // The instructions of a run can't stop the context, it only has to end before the scheduler or the caller would step in
+        const size_t left = SCHED_MAX_INSTRUCTIONS > context->c ? SCHED_MAX_INSTRUCTIONS - context->c : 1;
+        const uint32_t fused = fuse(context,steps-it < left ? steps-it : left,&opcode);
+        if ( fused ) {
+            it += fused-1;
+            goto instuction_end;
+        }
+    }
+#endif
+
+    if ( read_data(context,&context->pc,2,&instruction) ) { // Nothing to decode, the read error stops the context
+        opcode = 0;
+        goto instuction_end;
+    }
 
-    uint8_t opcode = instruction&255;
-    uint8_t opflag = instruction>>8;
+    opcode = instruction&255;
+    opflag = instruction>>8;
 
     // debug((context->pc-2)>>16,(context->pc-2)&0xffff,opcode);
 
+#ifdef EPU_PROFILE
+    profile_instruction(context,opcode,opflag,context->pc-2);
+#endif
+
+    if ( (opflag&15) > 2 && ( opcode == 1 || opcode == 2 || opcode == 4 || opcode == 5 || opcode == 7 || opcode == 9 || opcode == 10 || opcode == 11 ) ) { // Operands are at most 4 bytes wide
+        context->flags |= STATUS_BITS_ILLINST;
+        goto instuction_end;
+    }
+
     if (opcode == 0) { // HLT
         context->flags |= STATUS_BITS_HALT;
     }
@@ -467,23 +2366,25 @@ int loop(size_t steps) { for (size_t it = 0; it < steps; it++) {
         read_data(context,&context->pc,1,&io);
 
         uint32_t b = 0;
-        if ( opflag&16 ) // Imd
-            read_data(context,&context->pc,tz,&b);
+        if ( opflag&16 ) { // Imd ( with its own size when short )
+            const uint32_t iz = opflag&32 ? 1u<<(opflag>>6) : tz;
+            if ( iz > 4 ) {
+                context->flags |= STATUS_BITS_ILLINST;
+                goto instuction_end;
+            }
+            read_data(context,&context->pc,iz,&b);
+        }
         else // Reg
             b = (*getCPUReg(context,io>>4)) & sz;
 
         uint32_t* a = getCPUReg(context,io&15);
 
-             if (op == 0x00) *a = ((*a) + b)  & sz;
-        else if (op == 0x01) *a = ((*a) - b)  & sz;
-        else if (op == 0x02) *a = ((*a) * b)  & sz;
-        else if (op == 0x03) *a = ((*a) / b)  & sz;
-        else if (op == 0x04) *a = ((*a) & b)  & sz;
-        else if (op == 0x05) *a = ((*a) | b)  & sz;
-        else if (op == 0x06) *a = ((*a) ^ b)  & sz;
-        else if (op == 0x07) *a = ((*a) << b) & sz;
-        else if (op == 0x08) *a = ((*a) >> b) & sz;
-        else if (op == 0x09) *a = ((*a) % b)  & sz;
+        if ( (op == 0x03 || op == 0x09) && b == 0 ) { // Division by zero
+            context->flags |= STATUS_BITS_ILLINST;
+            goto instuction_end;
+        }
+
+        alu_apply(op,a,b,sz);
     }
 
     else if (opcode == 2) { // MOV
@@ -517,8 +2418,13 @@ int loop(size_t steps) { for (size_t it = 0; it < steps; it++) {
             read_data(context,&context->pc,4,&p);
             peek_data(context,p,tz,&src);
         }
-        if ( i == 3 ) { // Imd
-            read_data(context,&context->pc,tz,&src);
+        if ( i == 3 ) { // Imd ( with its own size when short )
+            const uint32_t iz = opflag&32 ? 1u<<(opflag>>6) : tz;
+            if ( iz > 4 ) {
+                context->flags |= STATUS_BITS_ILLINST;
+                goto instuction_end;
+            }
+            read_data(context,&context->pc,iz,&src);
         }
 
         if ( o == 0 ) { // Reg
@@ -588,20 +2494,7 @@ int loop(size_t steps) { for (size_t it = 0; it < steps; it++) {
             read_data(context,&context->pc,tz,&addr_off);
         }
 
-        uint32_t addr = (opflag&16 ? 0 : base) + (opflag&32 ? -addr_off : addr_off);
-
-        if ( (cond & 0xF0) == 0x00 ) {
-            if ( (context->cmp & (cond&0x0F)) != 0 )
-                context->pc = addr;
-        }
-
-        else if ( (cond & 0xF0) == 0x10 ) {
-            if ( (context->cmp & (cond&0x0F)) == 0 )
-                context->pc = addr;
-        }
-
-        else
-            context->flags |= STATUS_BITS_ILLINST;
+        jmp_apply(context,opflag,cond,base,addr_off);
     }
 
     else if (opcode == 5) { // CMP
@@ -610,7 +2503,6 @@ int loop(size_t steps) { for (size_t it = 0; it < steps; it++) {
         
         const uint8_t a_kind = ab_kind>>4;
         const uint8_t b_kind = ab_kind&15;
-        const uint32_t sz = SZ2MASK(opflag&15);
         const uint32_t tz = 1<<(opflag&15);
 
         if ( (a_kind == 1 || a_kind == 2) && ( b_kind == 1 || b_kind == 2 ) ) { // Illegal memory-memory comparision
@@ -618,10 +2510,10 @@ int loop(size_t steps) { for (size_t it = 0; it < steps; it++) {
             goto instuction_end;
         }
         
-        uint32_t a;
-        uint32_t b;
-        uint32_t p;
-        uint32_t q;
+        uint32_t a = 0;
+        uint32_t b = 0;
+        uint32_t p = 0;
+        uint32_t q = 0;
 
         if ( a_kind == 0 ) { // Reg
             read_data(context,&context->pc,1,&p);
@@ -663,40 +2555,51 @@ int loop(size_t steps) { for (size_t it = 0; it < steps; it++) {
             read_data(context,&context->pc,tz,&b);
         }
 
-        a &= sz;
-        b &= sz;
-
-        if ( !( opflag & 32 ) ) // Clear Compare Status
-            contexts->cmp = 0;
-
-        if ( opflag & 16 ) { // Signed Compare
-            int32_t sa = (opflag&15)==0 ? *(int8_t*)&a : (opflag&15)==1 ? *(int16_t*)&a : (opflag&15)==2 ? *(int32_t*)&a : 0;
-            int32_t sb = (opflag&15)==0 ? *(int8_t*)&b : (opflag&15)==1 ? *(int16_t*)&b : (opflag&15)==2 ? *(int32_t*)&b : 0;
-            if ( sa == sb )
-                context->cmp |= CMP_BITS_EQ;
-            if ( sa < sb )
-                context->cmp |= CMP_BITS_LT;
-            if ( sa > sb )
-                context->cmp |= CMP_BITS_GT;
-        } else { // Unsigned Compare
-            if ( a == b )
-                context->cmp |= CMP_BITS_EQ;
-            if ( a < b )
-                context->cmp |= CMP_BITS_LT;
-            if ( a > b )
-                context->cmp |= CMP_BITS_GT;
-        }
+        cmp_apply(context,opflag,a,b);
     }
 
     else if (opcode == 6) { // INT
         uint32_t interrupt;
         read_data(context,&context->pc,4,&interrupt);
 
+#ifdef EPU_PROFILE
+        epu_profile.ints[(interrupt>>8)&255][interrupt&255]++;
+#endif
+
+        core_lock_take();
+
         if (interrupt >= 0x0100 && interrupt <= 0x01FF) {
             uint8_t cmd = interrupt&255;
             switch (cmd) {
                 case 0: { // Random number
-                    context->ra = ge_random();
+                    context->ra = host_random();
+                } break;
+                case 1: { // Read Clock
+                    /*
+                        RA : Low 32 bits of the emulated cycle count
+                        RB : High 32 bits of the emulated cycle count
+                    */
+                    context->ra = epu_cycles;
+                    context->rb = epu_cycles>>32;
+                } break;
+                case 2: { // Sleep
+                    /*
+                        RA : Low 32 bits of the cycle to wake up at
+                        RB : High 32 bits of the cycle to wake up at
+                    */
+                    context->wake = ((uint64_t)context->rb<<32)|context->ra;
+                } break;
+                case 3: { // Wait For Event
+                    /*
+                        RA : Events to wait on ( 1 key, 2 timer, 4 video acknowledgement, 8 bus completion ), set to the events that ended the wait
+                        RB : Low 32 bits of the timer deadline cycle
+                        RC : High 32 bits of the timer deadline cycle
+                    */
+                    context->wait = context->ra & 0b1111;
+                    if ( context->wait & EVENT_BITS_TIMER )
+                        context->wake = ((uint64_t)context->rc<<32)|context->rb;
+                    if ( !context->wait )
+                        context->ra = 0;
                 } break;
                 default:
                     // TODO: Illegal instruction?
@@ -704,6 +2607,133 @@ int loop(size_t steps) { for (size_t it = 0; it < steps; it++) {
             }
         }
 
+        if (interrupt >= 0x0200 && interrupt <= 0x02FF) {
+            uint8_t cmd = interrupt&255;
+            if (context->s) { // Kernel only
+                context->flags |= STATUS_BITS_ILLINST;
+                core_lock_drop();
+                goto instuction_end;
+            }
+            switch (cmd) {
+                case 0: { // Share Memory
+                    /*
+                        RA : Destination space ( not the kernel's ), replaced by 0 on success
+                        RB : Source space
+                        RC : Segments ( 1: data, 2: code, 4: ropd )
+                    */
+                    if (!context->ra || context->ra > 255 || context->rb > 255) {
+                        context->ra = 1;
+                        break;
+                    }
+                    mem_share(context->ra,context->rb,context->rc);
+                    context->ra = 0;
+                } break;
+                case 1: { // Spawn Context
+                    /*
+                        RA : Context ( also its space ), replaced by 0 on success
+                        RB : Entry point
+                        RC : Segments inherited from the current space ( 1: data, 2: code, 4: ropd ), the others start zeroed
+                             unless 8 is set, which keeps them as they are ( an executable loaded with 0x0202 )
+                    */
+                    const uint8_t id = context->ra;
+                    if (!id || context->ra > 255 || __atomic_load_n(&contexts[id].alive,__ATOMIC_ACQUIRE)) {
+                        context->ra = 1;
+                        break;
+                    }
+                    mem_share(id,context->s,context->rc);
+                    for (uint8_t seg = 0; seg < 3 && !(context->rc&8); seg++) if (!(context->rc&(1<<seg))) {
+                        for (uint8_t page = 0; page < MEM_PAGE_COUNT; page++) // Only costs anything for the pages that were written
+                            mem_page_zero(id,seg,page);
+                    }
+                    const epu_ctx spawned = {
+                        .s = id,
+                        .pc = context->rb,
+                        .cp = 0x0000F000,
+                    };
+                    const size_t skip = (uint8_t*)&spawned.c-(uint8_t*)&spawned; // Leaves `alive` to the atomic store
+                    memcpy((uint8_t*)&contexts[id]+skip,(const uint8_t*)&spawned+skip,sizeof(epu_ctx)-skip);
+                    __atomic_store_n(&contexts[id].alive,1,__ATOMIC_RELEASE); // Last, the core of the context may be looking at it
+                    context->ra = 0;
+                } break;
+                case 2: { // Load Executable
+                    /*
+                        RA : Space ( of a context that isn't alive ), replaced by the entry point, or 0 if the executable is malformed
+                        RB : Address of the executable ( see exec.h ), outside of the segments of the space it is loaded into
+                        RC : Size of the executable
+                    */
+                    const uint8_t id = context->ra;
+                    if (!id || context->ra > 255 || __atomic_load_n(&contexts[id].alive,__ATOMIC_ACQUIRE)) {
+                        context->ra = 0;
+                        break;
+                    }
+                    context->ra = exec_load(context,context->rb,context->rc,id,0);
+                } break;
+                default:
+                    context->flags |= STATUS_BITS_ILLINST;
+                    break;
+            }
+        }
+
+        if (interrupt >= 0x0300 && interrupt <= 0x03FF) {
+            uint8_t cmd = interrupt&255;
+            switch (cmd) {
+                case 0: { // Copy Memory
+                    /*
+                        RA : Destination
+                        RB : Source
+                        RC : Size
+                    */
+                    mem_copy(context,context->ra,context->rb,context->rc);
+                } break;
+                case 1: { // Fill Memory
+                    /*
+                        RA : Destination
+                        RB : Value
+                        RC : Size
+                    */
+                    mem_fill(context,context->ra,context->rb,context->rc);
+                } break;
+                default:
+                    context->flags |= STATUS_BITS_ILLINST;
+                    break;
+            }
+        }
+
+        if (interrupt >= 0x0400 && interrupt <= 0x04FF) {
+            uint8_t cmd = interrupt&255;
+            if (context->s) { // Kernel only
+                context->flags |= STATUS_BITS_ILLINST;
+                core_lock_drop();
+                goto instuction_end;
+            }
+            switch (cmd) {
+                case 0: { // Set Up Bus
+                    /*
+                        RA : Address of the rings ( see bus.h, in the data of a space, 0 to turn the bus off ), replaced by 0 on success
+                    */
+                    uint8_t space, seg;
+                    if (!context->ra)
+                        bus_ring = 0;
+                    else if (mem_region(context,context->ra,1,&space,&seg) != 1 || seg != MEM_SEG_DATA || (context->ra&0xFFFF)+BUS_RING_BYTES > 65536) {
+                        context->ra = 1;
+                        break;
+                    }
+                    else
+                        bus_ring = 1<<24 | space<<16 | (context->ra&0xFFFF);
+                    context->ra = 0;
+                } break;
+                case 1: { // Ring Doorbell
+                    /*
+                        RA : Set to the amount of commands completed right away ( the others raise EVENT_BITS_BUS when they do )
+                    */
+                    context->ra = bus_doorbell();
+                } break;
+                default:
+                    context->flags |= STATUS_BITS_ILLINST;
+                    break;
+            }
+        }
+
         if (interrupt >= 0xFF00 && interrupt <= 0xFFFF) {
             uint8_t cmd = interrupt&255;
             switch (cmd) {
@@ -731,33 +2761,25 @@ int loop(size_t steps) { for (size_t it = 0; it < steps; it++) {
                         y *= 8;
                     }
 
-                    const uint32_t c = context->rc;
-                    uint32_t fg = graphics_palette[context->re];
-                    uint32_t bg = graphics_palette[context->rf];
-                    
-                    uint8_t* chardata = graphics_chars[0].data;
-                    for (size_t i = 0; i < sizeof(graphics_chars); i++) {
-                        if (graphics_chars[i].character == c) {
-                            chardata = graphics_chars[i].data;
-                            break;
-                        }
-                    }
-                    
-                    for (size_t dy = 0; dy < 8; dy++) {
-                        uint8_t l = chardata[dy];
-                        for (size_t dx = 0; dx < 8; dx++) {
-                            const uint32_t pcolor = l&(1<<(7-dx)) ? fg : bg;
-                            color* pix = &screen[(y+dy)*WIDTH+(x+dx)];
-                            pix->r = pcolor&255;
-                            pix->g = (pcolor>>8)&255;
-                            pix->b = (pcolor>>16)&255;
-                        }
-                    }
+                    if ( x > WIDTH-8 || y > HEIGHT-8 ) // Off screen, clipped as a whole
+                        break;
+
+                    draw_char(x,y,context->rc,context->re,context->rf);
                 } break;
                 case 1: { // Draw Pixel
                     uint32_t x = context->ra;
                     uint32_t y = context->rb;
-                    uint32_t c = graphics_palette[context->rc];
+                    uint32_t c = graphics_palette[context->rc&255];
+
+                    if ( x >= WIDTH || y >= HEIGHT )
+                        break;
+
+                    video_touch(y,1);
+
+                    if (video_mode == VIDEO_MODE_INDEXED) {
+                        screen_indices[y*WIDTH+x] = context->rc;
+                        break;
+                    }
 
                     color* pix = &screen[y*WIDTH+x];
 
@@ -765,29 +2787,67 @@ int loop(size_t steps) { for (size_t it = 0; it < steps; it++) {
                     pix->g = (c>>8)&255;
                     pix->b = (c>>16)&255;
                 } break;
+                case 2: { // Set Video Mode
+                    /*
+                        RA : Mode
+                            0 => Direct, draws write colors to the screen
+                            1 => Indexed, draws write palette indices, turned into colors when sending the video
+                                 ( so palette changes recolor everything that was drawn )
+                    */
+                    if (context->ra > VIDEO_MODE_INDEXED) {
+                        context->flags |= STATUS_BITS_ILLINST;
+                        break;
+                    }
+                    video_mode = context->ra;
+                    video_touch(0,HEIGHT);
+                    memset(text_drawn,0,sizeof(text_drawn)); // The cells were drawn into the other framebuffer
+                } break;
+                case 3: { // Set Palette Entry
+                    /*
+                        RA : Index
+                        RB : Color ( 0xBBGGRR )
+                    */
+                    graphics_palette[context->ra&255] = context->rb;
+                    video_touch(0,HEIGHT); // Sprites go through the palette in both modes
+                } break;
                 case 15: { // Send Video
                     send_video();
                 } break;
                 case 16: { // Pull Character
-                    context->ra = ge_keys_last();
+                    input_sync();
+                    context->ra = input_chars_head != input_chars_tail ? input_chars[input_chars_tail++%sizeof(input_chars)] : 0;
                 } break;
                 case 17: { // Get pressed
-                    keys pressed;
-                    ge_keys_pressed(&pressed);
-                    context->ra = pressed.a;
-                    context->rb = pressed.b;
+                    input_sync();
+                    context->ra = input_keys.a;
+                    context->rb = input_keys.b;
+                } break;
+                case 18: { // Get Mouse
+                    /*
+                        RA : X position
+                        RB : Y position
+                        RC : Held buttons ( 1 left, 2 right, 4 middle )
+                    */
+                    input_sync();
+                    context->ra = mouse_x;
+                    context->rb = mouse_y;
+                    context->rc = mouse_buttons;
                 } break;
                 default:
                     // TODO: illegal instruction?
                     break;
             }
         }
+
+        core_lock_drop();
     }
 
     else if (opcode == 7) { // Call
         const uint32_t sz = SZ2MASK(opflag&15);
         const uint32_t tz = 1<<(opflag&15);
 
+        uint32_t base = context->pc-2;
+
         uint8_t src;
         read_data(context,&context->pc,1,&src);
         
@@ -806,6 +2866,9 @@ int loop(size_t steps) { for (size_t it = 0; it < steps; it++) {
             read_data(context,&context->pc,tz,&addr);
         }
 
+        if ( opflag&16 ) // Relative ( unlike JMP, calls are absolute by default )
+            addr = base + (opflag&32 ? -addr : addr);
+
         push(context,4,&context->cp,&context->pc);
         context->pc = addr;
     }
@@ -816,18 +2879,206 @@ int loop(size_t steps) { for (size_t it = 0; it < steps; it++) {
         context->pc = addr;
     }
 
+    else if (opcode == 9) { // Atomic
+        const uint32_t sz = SZ2MASK(opflag&15);
+        const uint32_t tz = 1<<(opflag&15);
+
+        uint8_t op;
+        read_data(context,&context->pc,1,&op);
+
+        uint8_t io;
+        read_data(context,&context->pc,1,&io);
+
+        if ( op == 0x03 ) { // Fence
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            goto instuction_end;
+        }
+
+        const uint32_t addr = *getCPUReg(context,io&15);
+        uint32_t* v = getCPUReg(context,io>>4);
+
+        if ( op > 0x03 || addr & (tz-1) ) { // Unknown operation or misaligned value
+            context->flags |= STATUS_BITS_ILLINST;
+            goto instuction_end;
+        }
+
+        uint8_t space, seg;
+        if ( mem_region(context,addr,1,&space,&seg) != 1 ) { // Only the memory of the spaces can be updated atomically
+            context->flags |= STATUS_BITS_WRITERR;
+            goto instuction_end;
+        }
+
+        const uint32_t old = atom_apply(op,mem_write_ptr(space,seg,addr),tz,*v & sz,context->ra & sz);
+        if ( op == 0x02 ) { // CAS, RA holds the expected value and gets the old one
+            context->cmp = old == (context->ra & sz) ? CMP_BITS_EQ : 0;
+            context->ra = old;
+        }
+        else
+            *v = old;
+    }
+
+    else if (opcode == 10 || opcode == 11) { // PUSH, POP
+        const uint32_t sz = SZ2MASK(opflag&15);
+        const uint32_t tz = 1<<(opflag&15);
+
+        uint16_t mask;
+        read_data(context,&context->pc,2,&mask);
+
+        if ( opflag&16 ) { // Moves the stack pointer from ( PUSH ) or into ( POP ) the register in the low nibble
+            uint32_t* r = getCPUReg(context,mask&15);
+            if ( opcode == 10 )
+                context->sp = *r;
+            else
+                *r = context->sp;
+            goto instuction_end;
+        }
+
+        // The registers of the mask are stored in ascending order from the stack pointer, which grows upwards like `cp`
+        uint8_t block[16*4];
+        uint32_t size = 0;
+        if ( opcode == 10 ) {
+            for (uint8_t i = 0; i < 16; i++) if ( mask>>i&1 ) {
+                const uint32_t v = *getCPUReg(context,i) & sz;
+                memcpy(block+size,&v,tz);
+                size += tz;
+            }
+            if ( !mem_transfer(context,context->sp,block,size,1) )
+                context->sp += size;
+        } else {
+            for (uint8_t i = 0; i < 16; i++)
+                size += (mask>>i&1)*tz;
+            const uint32_t window = context->sp>>24 == 0xFF || context->sp>>24 == VRAM_PAGE ? 0xFFFFFF : 0xFFFF; // As in `mem_advance`
+            if ( size > (context->sp&window) ) // The block would start below its window
+                context->flags |= STATUS_BITS_READERR;
+            else if ( !mem_transfer(context,context->sp-size,block,size,0) ) {
+                context->sp -= size;
+                size = 0;
+                for (uint8_t i = 0; i < 16; i++) if ( mask>>i&1 ) {
+                    uint32_t v = 0;
+                    memcpy(&v,block+size,tz);
+                    *getCPUReg(context,i) = v;
+                    size += tz;
+                }
+            }
+        }
+    }
+
     instuction_end:
 
-    if ( !contexts[0].alive )
+    epu_cycles += 1 + cycle_costs[opcode];
+    epu_steps++;
+
+    if ( !__atomic_load_n(&contexts[0].alive,__ATOMIC_RELAXED) ) // The kernel may run on another core
         return 1;
     
-    if ( ++context->c >= SCHED_MAX_INSTRUCTIONS || context->flags & STATUS_MASK_STOP ) {
+    if ( ++context->c >= SCHED_MAX_INSTRUCTIONS || context->flags & STATUS_MASK_STOP || !ctx_runnable(context) ) {
         context->c = 0;
         if ( context->flags & STATUS_MASK_STOP ) {
-            context->alive = 0;
+            __atomic_store_n(&context->alive,0,__ATOMIC_RELEASE);
         }
-        if ( !contexts[0].alive )
+        if ( !__atomic_load_n(&contexts[0].alive,__ATOMIC_RELAXED) )
             return context->flags;
-        while ( !contexts[++curr_context].alive ) ;
+        if ( !schedule() )
+            return 0;
+#ifdef EPU_PROFILE
+        if ( &contexts[curr_context] != context )
+            epu_profile.switches[curr_context]++;
+#endif
+    }
+} return 0;}
+
+/* Runs the core while replaying, stopping between instructions for the events of the log, returns like `loop` */
+int replay_loop( uint32_t steps ) {
+    const uint64_t end = epu_steps+steps;
+    while (replay_mode == REPLAY_PLAY && epu_steps < end) {
+        uint64_t target = end;
+        uint8_t type;
+        uint64_t at;
+        uint32_t pos;
+        if (replay_peek(&type,&at,&pos)) {
+            if (at < epu_steps) { // The entry was due at an instruction that didn't ask for it
+                replay_mode = REPLAY_DESYNC;
+                break;
+            }
+            if (type == REPLAY_ENTRY_EVENT && at == epu_steps) {
+                uint64_t events;
+                replay_take(REPLAY_ENTRY_EVENT,&events,0,0);
+                raise_events(events);
+                continue;
+            }
+            if (type == REPLAY_ENTRY_COMPLETION && at == epu_steps) {
+                bus_completion done;
+                replay_take(REPLAY_ENTRY_COMPLETION,0,&done,sizeof(done));
+                bus_finish(&done);
+                continue;
+            }
+            if (at < target)
+                target = at > epu_steps ? at : epu_steps+1;
+        }
+        const uint64_t before = epu_steps;
+        const int status = loop(target-epu_steps);
+        if (status)
+            return status;
+        if (epu_steps == before && clock_idle() == 0xFFFFFFFF) { // Blocked, but the log has nothing to wake the core up
+            replay_mode = REPLAY_DESYNC;
+            break;
+        }
+    }
+    return 0;
+}
+
+/*
+    Spreads the contexts over `n` cores ( 1, 2, 4 or 8, so that each core gets the same share of the contexts ), returns 1 if
+    the build can't ( several cores need EPU_THREADS, and can't be profiled or replayed ).
+*/
+int epu_set_cores( uint32_t n ) {
+#if !defined(EPU_THREADS) || defined(EPU_PROFILE)
+    if (n != 1)
+        return 1;
+#endif
+    if (!n || n > EPU_MAX_CORES || (n & (n-1)) || (n > 1 && replay_mode != REPLAY_OFF))
+        return 1;
+    epu_cores = n;
+    cores_clock = epu_cycles;
+    memset(core_steps,0,sizeof(core_steps));
+    return 0;
+}
+
+/*
+    Runs a quantum of a core ( at most `steps` instructions of the contexts it holds ), returns like `loop`. Every core runs on
+    its own host thread, core 0 on the one making all the other calls into the core. Once all of them returned, the host calls
+    `cores_sync` before starting the next quantum.
+    Contexts on different cores only see each other through memory ( see ATOM ), the cores' clocks only meet at `cores_sync`.
+*/
+int loop_core( uint32_t core, uint32_t steps ) {
+    if (core >= epu_cores)
+        return 0;
+    core_id = core;
+    if (curr_context % epu_cores != core)
+        curr_context = core;
+    if (core)
+        epu_cycles = cores_clock;
+    const uint64_t start = epu_steps;
+    const int status = loop(steps);
+    core_clocks[core] = epu_cycles;
+    core_steps[core] = epu_steps-start;
+    return status;
+}
+
+/* Merges the clocks and the instruction counts of the cores after a quantum, time skips ahead when none of them ran anything */
+void cores_sync() {
+    uint64_t ran = core_steps[0];
+    for (uint32_t i = 1; i < epu_cores; i++) {
+        if (core_clocks[i] > epu_cycles)
+            epu_cycles = core_clocks[i];
+        epu_steps += core_steps[i];
+        ran += core_steps[i];
     }
-} return 0;}
\ No newline at end of file
+    if (!ran) {
+        const uint32_t idle = clock_idle();
+        if (idle != 0xFFFFFFFF)
+            epu_cycles += idle;
+    }
+    memset(core_steps,0,sizeof(core_steps));
+    cores_clock = epu_cycles;
+}
@@ -0,0 +1,42 @@
+#ifndef exec_h
+#define exec_h
+
+/* "EPUX" */
+#define EXEC_MAGIC   0x58555045
+#define EXEC_VERSION 1
+
+#define EXEC_SECTION_CODE 0
+#define EXEC_SECTION_DATA 1
+#define EXEC_SECTION_ROPD 2
+
+/*
+    Layout of an executable ( all integers are little-endian ):
+        exec_header
+        code        ( `code_size` bytes )
+        data        ( `data_size` bytes, then `bss_size` bytes of zeroes that aren't stored )
+        ropd        ( `ropd_size` bytes )
+        relocations ( `relocs` x exec_reloc )
+    Each section is loaded at the start of its segment: code at 0x10000000 ( 0xFF000000 as the boot program ), data at
+    0x00000000 and ropd at 0x12000000. Addresses stored in the sections are offsets into the section they point to, the
+    relocations add the address that section was loaded at.
+*/
+typedef struct exec_header_t {
+    uint32_t magic;     // EXEC_MAGIC
+    uint32_t version;   // EXEC_VERSION
+    uint32_t entry;     // Offset of the entry point in the code
+    uint32_t code_size;
+    uint32_t data_size;
+    uint32_t bss_size;
+    uint32_t ropd_size;
+    uint32_t relocs;    // Amount of relocations
+} exec_header;
+
+/* A 32-bit address stored in a section */
+typedef struct exec_reloc_t {
+    uint32_t offset;  // Of the address in its section
+    uint8_t section;  // EXEC_SECTION_* holding the address
+    uint8_t target;   // EXEC_SECTION_* the address points into
+    uint16_t pad;
+} exec_reloc;
+
+#endif
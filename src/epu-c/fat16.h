@@ -2,6 +2,7 @@
 #define fat_h
 
 #include "inttypes.h"
+#include "memory.h"
 #include "string.h"
 
 typedef struct fat_boot_sector_t {
@@ -80,35 +81,65 @@ typedef struct fat_file_t {
 typedef struct fat_disk_t {
     uint8_t* data;
     fat_boot_sector* boot;
+    uint32_t size; // Size of the image in bytes, nothing past it is read
+    int (*load)(struct fat_disk_t* disk, uint32_t addr, uint32_t size); // Fills in a range of `data` before it is read ( 0 when all of it already is ), returns 1 if it can't
 } __attribute__((packed)) fat_disk;
 
-/* Reads the boot sector from a disk and writes it into the disk struct */
-void fat_read_boot_sector(fat_disk* disk) 
+/* Reads little-endian integers from anywhere in an image, aligned or not */
+uint16_t fat_u16(const uint8_t* data)
 #ifdef fat_impl
 {
+    return data[0] | data[1]<<8;
+}
+#endif
+;
+
+uint32_t fat_u32(const uint8_t* data)
+#ifdef fat_impl
+{
+    return data[0] | data[1]<<8 | data[2]<<16 | (uint32_t)data[3]<<24;
+}
+#endif
+;
+
+/* Makes sure a range of a disk can be read ( see `load` ), returns 1 if it can't */
+int fat_load(fat_disk* disk, uint32_t addr, uint32_t size)
+#ifdef fat_impl
+{
+    return disk->load ? disk->load(disk,addr,size) : 0;
+}
+#endif
+;
+
+/* Reads the boot sector from a disk and writes it into the disk struct, returns 1 if the image is too small to hold one */
+int fat_read_boot_sector(fat_disk* disk) 
+#ifdef fat_impl
+{
+    if (disk->size < 512 || fat_load(disk,0,512)) return 1;
     *disk->boot = (fat_boot_sector){
         .bootstrap_code1 = { 0 }, // TODO: read this
         .os_code = { disk->data[3], disk->data[4], disk->data[5], disk->data[6], disk->data[7], disk->data[8], disk->data[9], disk->data[10] }, // TODO: read this better
-        .sector_size = *(uint16_t*)(disk->data+0x000B),
+        .sector_size = fat_u16(disk->data+0x000B),
         .cluster_size = *(disk->data+0x000D),
-        .reserved_sectors = *(uint16_t*)(disk->data+0x000E),
+        .reserved_sectors = fat_u16(disk->data+0x000E),
         .copies = *(disk->data+0x0010),
-        .root_entries = *(uint16_t*)(disk->data+0x0011),
-        .sector_count_small = *(uint16_t*)(disk->data+0x0013),
+        .root_entries = fat_u16(disk->data+0x0011),
+        .sector_count_small = fat_u16(disk->data+0x0013),
         .media_descriptor = *(disk->data+0x0015),
-        .sectors_per_fat = *(uint16_t*)(disk->data+0x0016),
-        .sectors_per_track = *(uint16_t*)(disk->data+0x0018),
-        .sectors_per_head = *(uint16_t*)(disk->data+0x001A),
-        .hidden_sectors = *(uint32_t*)(disk->data+0x001C),
-        .sector_count_large = *(uint32_t*)(disk->data+0x0020),
+        .sectors_per_fat = fat_u16(disk->data+0x0016),
+        .sectors_per_track = fat_u16(disk->data+0x0018),
+        .sectors_per_head = fat_u16(disk->data+0x001A),
+        .hidden_sectors = fat_u32(disk->data+0x001C),
+        .sector_count_large = fat_u32(disk->data+0x0020),
         .drive_number = *(disk->data+0x0024),
         .reserved = *(disk->data+0x0025),
-        .boot_signature = *(uint32_t*)(disk->data+0x0027),
+        .boot_signature = fat_u32(disk->data+0x0027),
         .volume_label = { disk->data[0x002B+0], disk->data[0x002B+1], disk->data[0x002B+2], disk->data[0x002B+3], disk->data[0x002B+4], disk->data[0x002B+5], disk->data[0x002B+6], disk->data[0x002B+7], disk->data[0x002B+8], disk->data[0x002B+9], disk->data[0x002B+10] },// TODO: read this better
         .fs_type = { disk->data[0x0036+0], disk->data[0x0036+1], disk->data[0x0036+2], disk->data[0x0036+3], disk->data[0x0036+4], disk->data[0x0036+5], disk->data[0x0036+6], disk->data[0x0036+7] }, // TODO: read this better
         .bootstrap_code2 = { 0 }, // TODO: read this
-        .signature = *(uint16_t*)(disk->data+0x01FE)
+        .signature = fat_u16(disk->data+0x01FE)
     };
+    return 0;
 }
 #endif
 ;
@@ -123,13 +154,13 @@ void fat_read_file_small(uint8_t* data, fat_file_small* file)
         .attr = *(data+0x0B),
         .reserved = *(data+0x0C),
         .creation_ms = *(data+0x0D),
-        .creation_time = *(uint16_t*)(data+0x0E),
-        .creation_date = *(uint16_t*)(data+0x10),
-        .last_access_date = *(uint16_t*)(data+0x12),
-        .last_write_time = *(uint16_t*)(data+0x16),
-        .last_write_date = *(uint16_t*)(data+0x18),
-        .start_cluster = *(uint16_t*)(data+0x1A),
-        .file_size = *(uint32_t*)(data+0x1C)
+        .creation_time = fat_u16(data+0x0E),
+        .creation_date = fat_u16(data+0x10),
+        .last_access_date = fat_u16(data+0x12),
+        .last_write_time = fat_u16(data+0x16),
+        .last_write_date = fat_u16(data+0x18),
+        .start_cluster = fat_u16(data+0x1A),
+        .file_size = fat_u32(data+0x1C)
     };
 }
 #endif
@@ -184,23 +215,27 @@ size_t fat_addr_cluster(fat_disk* disk, int cluster)
 uint16_t fat_cluster_entry(fat_disk* disk, int cluster) 
 #ifdef fat_impl
 {
-    return *(uint16_t*)(disk->data+fat_addr(disk,fat_addr_fat_region(disk))+cluster*2);
+    return fat_u16(disk->data+fat_addr(disk,fat_addr_fat_region(disk))+cluster*2);
 }
 #endif
 ;
 
-/* Retrieves the 'boot' file of a disk (not standard) */
-int fat_boot_file(fat_disk* disk, void* data, int* size)
+/* Retrieves the 'boot' file of a disk (not standard), returns 1 if it is missing, larger than `capacity` or if the disk is corrupted */
+int fat_boot_file(fat_disk* disk, void* data, int* size, uint32_t capacity)
 #ifdef fat_impl
 {
+    // Everything is bound checked once per directory / cluster rather than per byte
+    if (disk->boot->sector_size == 0 || disk->boot->cluster_size == 0) return 1;
     const size_t cluster_size = disk->boot->cluster_size*disk->boot->sector_size;
     const size_t entries = disk->boot->root_entries;
     const size_t root_addr = fat_addr(disk,fat_addr_root_directory_region(disk));
-    if (entries == 0) return 1;
+    const size_t fat_addr_start = fat_addr(disk,fat_addr_fat_region(disk));
+    if (entries == 0 || root_addr > disk->size || entries*32 > disk->size-root_addr || fat_load(disk,root_addr,entries*32)) return 1;
     fat_file_small file;
     for (size_t i = 0; i < entries; i++) {
         fat_read_file_small(disk->data+root_addr+i*32,&file);
         if (!strcmpl(file.name,"BOOT    ",8) && !strcmpl(file.ext,"   ",3)) {
+            if (file.file_size > capacity || file.file_size > 0x7FFFFFFF) return 1;
             if (size) {
                 *size = file.file_size;
             }
@@ -209,10 +244,12 @@ int fat_boot_file(fat_disk* disk, void* data, int* size)
                 size_t written = 0;
                 for (;;) {
                     const size_t data_addr = fat_addr(disk,fat_addr_cluster(disk,cluster));
-                    for (size_t i = 0; i < cluster_size && written < file.file_size; i++) {
-                        ((uint8_t*)data)[written++] = disk->data[data_addr+i];
-                    }
+                    const size_t chunk = file.file_size-written < cluster_size ? file.file_size-written : cluster_size;
+                    if (data_addr > disk->size || chunk > disk->size-data_addr || fat_load(disk,data_addr,chunk)) return 1;
+                    memcpy((uint8_t*)data+written,disk->data+data_addr,chunk);
+                    written += chunk;
                     if (cluster < 0x0003 || cluster > 0xFFEF || written >= file.file_size) break;
+                    if (fat_addr_start > disk->size || cluster*2u+2u > disk->size-fat_addr_start || fat_load(disk,fat_addr_start+cluster*2u,2)) return 1;
                     cluster = fat_cluster_entry(disk,cluster);
                 }
             }
@@ -232,24 +269,24 @@ void fat_read_file_entry(uint8_t* data, fat_file* file)
         .name = {' '},
         .ext = {' '},
         .flags = *(data+0x0B),
-        .size = *(uint32_t*)(data+0x1C),
+        .size = fat_u32(data+0x1C),
         .creation = {
             .cs  = 0,
-            .time = *(uint16_t*)(data+0x0E),
-            .date = *(uint16_t*)(data+0x10)
+            .time = fat_u16(data+0x0E),
+            .date = fat_u16(data+0x10)
         },
         .last_read = { 
             .cs = 0,
             .time = 0,
-            .date = *(uint16_t*)(data+0x12),
+            .date = fat_u16(data+0x12),
         },
         .last_write = {
             .cs = 0,
-            .time = *(uint16_t*)(data+0x16),
-            .date = *(uint16_t*)(data+0x18),
+            .time = fat_u16(data+0x16),
+            .date = fat_u16(data+0x18),
         },
         ._data = data,
-        ._start =  *(uint16_t*)(data+0x1A),
+        ._start =  fat_u16(data+0x1A),
     };
 
     // TODO: Somehow handle LFN entries
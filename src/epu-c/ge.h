@@ -6,17 +6,34 @@ extern void ge_screen_set( void* data, int x, int y, int width, int height );
 extern void ge_screen_push( void );
 /* Returns the size of the screen */
 extern void ge_screen_get_size( int* width, int* height );
-/* Returns the position of the mouse */
-extern void ge_mouse_pos( int* x, int* y );
-/* Returns a bitmask of the held keys */
-extern void ge_keys_pressed( void* pressed );
-/* Returns the last character pressed */
-extern int ge_keys_last( void );
 /* Returns a random 32-bit number */
 extern int32_t ge_random( void );
 
 extern void debug();
 
+#define INPUT_RING_SIZE 256 // Must be a power of two
+
+#define INPUT_KEY_DOWN 1
+#define INPUT_KEY_UP   2
+#define INPUT_MOUSE    3
+
+/* An input event, translated by the host */
+typedef struct input_event_t {
+    uint8_t type; // INPUT_*
+    uint8_t key; // Bit of the key in the held keys ( 0-31 in `a`, 32-63 in `b` ), 255 if it has none
+    uint8_t code; // Character of the key, 0 if it has none
+    uint8_t buttons; // Held mouse buttons
+    int16_t dx; // Horizontal mouse movement in pixels
+    int16_t dy; // Vertical mouse movement in pixels
+} input_event;
+
+/* Single-producer / single-consumer queue of input events, the host only ever writes `head` and the core `tail` */
+typedef struct input_ring_t {
+    uint32_t head;
+    uint32_t tail;
+    input_event events[INPUT_RING_SIZE];
+} input_ring;
+
 typedef struct keys_t {
     uint32_t a;
     uint32_t b;
@@ -32,4 +49,22 @@ typedef struct image_t {
     unsigned char* img;
     int w;
     int h;
-} image;
\ No newline at end of file
+} image;
+
+#define SPRITE_COUNT 64
+
+#define SPRITE_BITS_KEYED 0b00000001 // Pixels of value 0 are transparent
+
+/* An entry of the sprite table, the pixels are palette indices read from the memory of a space, row after row */
+typedef struct sprite_t {
+    int16_t x; // Position of the top left corner, can be partly off screen
+    int16_t y;
+    uint8_t w; // Size in pixels, 0 hides the sprite
+    uint8_t h;
+    uint8_t color; // Added to each pixel before looking it up in the palette
+    uint8_t flags; // SPRITE_BITS_*
+    uint8_t space; // Space the pixels are read from
+    uint8_t seg; // Segment of the space ( 0: data, 2: ropd )
+    uint16_t addr; // Address of the first pixel in the segment
+    uint32_t pad;
+} sprite;
\ No newline at end of file
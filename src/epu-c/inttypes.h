@@ -4,12 +4,14 @@
 typedef unsigned char uint8_t;
 typedef unsigned short int uint16_t;
 typedef unsigned int uint32_t;
+typedef unsigned long long uint64_t;
 
 typedef char int8_t;
 typedef short int int16_t;
 typedef int int32_t;
+typedef long long int64_t;
 
-typedef unsigned int size_t;
+typedef __SIZE_TYPE__ size_t; // The C library's, the core can be linked against one
 
 #define false 0
 #define true 1
@@ -1,2 +1,3 @@
-extern void* memset(void* pointer, uint8_t value, size_t count);
-extern void* memcpy(void* destination, const void* source, size_t size);
\ No newline at end of file
+extern void* memset(void* pointer, int value, size_t count);
+extern void* memcpy(void* destination, const void* source, size_t size);
+extern void* memmove(void* destination, const void* source, size_t size);
\ No newline at end of file
@@ -0,0 +1,23 @@
+#ifndef profile_h
+#define profile_h
+
+/* Amount of executed instructions between two samples of the program counter */
+#define PROFILE_PC_PERIOD  64
+/* Amount of program counter buckets per context space ( 16 bytes of the low 16 bits of the address each ) */
+#define PROFILE_PC_BUCKETS 4096
+#define PROFILE_PC_SHIFT   4
+
+/* Counters collected by the core when compiled with EPU_PROFILE */
+typedef struct profile_t {
+    uint32_t version;
+    uint32_t instructions;                    // Executed instructions
+    uint32_t fused;                           // Instructions run as part of a superinstruction, without a dispatch of their own
+    uint32_t ops[256][256];                   // Executed instructions per opcode and opflag
+    uint32_t pcs[256][PROFILE_PC_BUCKETS];    // Sampled program counters per context space
+    uint32_t switches[256];                   // Context switches into each context
+    uint32_t ints[256][256];                  // Interrupt calls per range ( high byte ) and command
+} profile;
+
+#define PROFILE_VERSION 2
+
+#endif
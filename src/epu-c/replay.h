@@ -0,0 +1,26 @@
+#ifndef replay_h
+#define replay_h
+
+/* States of the recorder ( see `replay_state` ) */
+#define REPLAY_OFF    0
+#define REPLAY_RECORD 1 // Host call results are appended to the log
+#define REPLAY_PLAY   2 // Host call results are read back from the log
+#define REPLAY_FULL   3 // Recording stopped, the log buffer ran out of space
+#define REPLAY_END    4 // Replaying stopped, the whole log was played back
+#define REPLAY_DESYNC 5 // Replaying stopped, the core asked for something the log doesn't have next
+
+/*
+    A log is a sequence of entries:
+        uint8_t type         ( REPLAY_ENTRY_* )
+        varint  steps        ( instructions executed since the previous entry )
+        payload
+    Varints are unsigned LEB128. Instructions are counted from `replay_start`, which is meant to happen right after restoring
+    or taking a snapshot: the snapshot and the log together reproduce a run.
+*/
+#define REPLAY_ENTRY_RANDOM 1 // varint: result of `ge_random`
+#define REPLAY_ENTRY_INPUT  2 // input_event: event drained from the input ring
+#define REPLAY_ENTRY_EVENT  3 // varint: events raised by the host through `epu_event`, between two instructions
+#define REPLAY_ENTRY_BUS    4 // int32_t x commands: results of the commands of a doorbell ( see bus.h )
+#define REPLAY_ENTRY_COMPLETION 5 // bus_completion: command completed by the host through `bus_complete`, between two instructions
+
+#endif
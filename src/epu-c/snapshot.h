@@ -0,0 +1,60 @@
+#ifndef snapshot_h
+#define snapshot_h
+
+/* "EPUS" */
+#define SNAPSHOT_MAGIC   0x53555045
+#define SNAPSHOT_VERSION 5
+
+/*
+    Layout of a snapshot ( all integers are little-endian ):
+        snapshot_header
+        palette        ( 256 x uint32_t )
+        screen         ( WIDTH x HEIGHT x 3 bytes )
+        screen indices ( WIDTH x HEIGHT bytes )
+        text cells     ( WIDTH/8 x HEIGHT/8 x uint32_t, twice: the cells then the cells as they were last drawn )
+        sprites        ( 64 x 16 bytes, see `sprite` in ge.h )
+        boot program   ( `boot_size` bytes, full snapshots only )
+        contexts       ( `contexts` x `ctx_size` bytes: uint32_t id then the raw context )
+        mappings       ( `mappings` x snapshot_mapping )
+        pages          ( `pages` x snapshot_page, each followed by the page's data )
+*/
+typedef struct snapshot_header_t {
+    uint32_t magic;     // SNAPSHOT_MAGIC
+    uint32_t version;   // SNAPSHOT_VERSION
+    uint32_t size;      // Size of the whole snapshot in bytes
+    uint32_t ctx_size;  // Size of a context record, snapshots only load into the build that made them
+    uint32_t base;      // Generation of the snapshot this one is a delta against ( 0 for a full snapshot )
+    uint32_t gen;       // Generation of this snapshot
+    uint32_t boot_size; // Size of the boot program
+    uint32_t contexts;  // Amount of context records
+    uint32_t mappings;  // Amount of shared page records
+    uint32_t pages;     // Amount of page records
+    uint32_t cycles_lo; // Emulated clock
+    uint32_t cycles_hi;
+    uint32_t curr_context;
+    uint32_t video_mode;
+    uint32_t bus_ring;  // Rings of the peripheral bus ( 1<<24 | space<<16 | address, 0 if they aren't set up )
+} snapshot_header;
+
+/* Size of the palette, both framebuffers, the text layer and the sprites, between the header and the boot program */
+#define SNAPSHOT_VIDEO_SIZE(width,height) ( 256*4 + (width)*(height)*3 + (width)*(height) + (width)/8*((height)/8)*4*2 + 64*16 )
+
+/* A page table entry that differs from a space owning its own page */
+typedef struct snapshot_mapping_t {
+    uint8_t space;
+    uint8_t seg;
+    uint8_t page;
+    uint8_t owner;
+    uint8_t shared;
+    uint8_t pad[3];
+} snapshot_mapping;
+
+/* A page written since the base snapshot, followed by its data */
+typedef struct snapshot_page_t {
+    uint8_t space;
+    uint8_t seg;
+    uint8_t page;
+    uint8_t pad;
+} snapshot_page;
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef stream_h
+#define stream_h
+
+/* "EPUV" */
+#define STREAM_MAGIC   0x56555045
+#define STREAM_VERSION 1
+
+#define STREAM_TILE 16 // Width and height of a tile, the ones on the right and bottom edges are cut to fit the screen
+
+#define STREAM_TILE_RAW 0
+#define STREAM_TILE_RLE 1
+
+/*
+    Layout of a video stream ( all integers are little-endian ):
+        stream_header
+        frames, each a stream_frame followed by `tiles` tiles:
+            stream_tile
+            STREAM_TILE_RAW : the RGB pixels of the tile, row by row
+            STREAM_TILE_RLE : a palette of `colors`+1 RGB colors, then runs of ( length-1, palette index ) byte pairs
+                              covering the pixels of the tile row by row
+    A frame only holds the tiles that changed since the one before it, the first one holds all of them. Presented frames
+    where nothing changed aren't written at all.
+*/
+typedef struct stream_header_t {
+    uint32_t magic;   // STREAM_MAGIC
+    uint32_t version; // STREAM_VERSION
+    uint16_t width;
+    uint16_t height;
+    uint16_t tile;    // STREAM_TILE
+    uint16_t pad;
+} stream_header;
+
+typedef struct stream_frame_t {
+    uint32_t size;  // Of the tiles that follow, in bytes
+    uint32_t frame; // Number of the presented frame, starting at 1
+    uint16_t tiles; // Amount of tiles that follow
+    uint16_t pad;
+} stream_frame;
+
+typedef struct stream_tile_t {
+    uint16_t index;  // Of the tile, row by row
+    uint8_t mode;    // STREAM_TILE_*
+    uint8_t colors;  // Size of the palette minus one ( STREAM_TILE_RLE )
+} stream_tile;
+
+#endif
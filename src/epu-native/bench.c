@@ -0,0 +1,99 @@
+/*
+    Benchmark of the video kernels of the EPU core
+
+    Times `clear_screen`, `blit_image`, `expand_palette` and `sprite_row` over whole frames and prints the cost per frame.
+    tasks/build-bench.sh also builds the scalar kernels ( EPU_NO_SIMD ), to compare both.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#define WIDTH  256
+#define HEIGHT 168
+
+//// Core Interface ////
+
+extern void clear_screen( void );
+extern void blit_image( void* img, int ox, int oy );
+extern void expand_palette( void* dst, const uint8_t* src, unsigned int n, const uint32_t* palette );
+extern void sprite_row( void* dst, const uint8_t* src, unsigned int n, uint8_t add, int keyed );
+extern uint32_t graphics_palette[256];
+extern uint8_t screen[WIDTH*HEIGHT*3];
+
+/* Mirror of `image` ( src/epu-c/ge.h ) */
+typedef struct bench_image_t {
+    unsigned char* img;
+    int w;
+    int h;
+} bench_image;
+
+//// Host Calls ////
+
+void ge_screen_size( int width, int height ) { (void)width; (void)height; }
+void ge_screen_set( void* data, int x, int y, int width, int height ) { (void)data; (void)x; (void)y; (void)width; (void)height; }
+void ge_screen_push( void ) {}
+int32_t ge_random( void ) { return 0; }
+int epu_call_peripheral( int address, int a, int b, int c, int d ) { (void)address; (void)a; (void)b; (void)c; (void)d; return 0; }
+int epu_load_floppy( int index, void* data, int* size ) { (void)index; (void)data; (void)size; return 0; }
+
+//// Benchmarks ////
+
+static double now_ns( void ) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec*1e9+ts.tv_nsec;
+}
+
+static uint8_t indices[WIDTH*HEIGHT];
+static unsigned char image_data[WIDTH*HEIGHT];
+static uint8_t sprite_data[WIDTH*HEIGHT];
+static bench_image image = { image_data, WIDTH, HEIGHT };
+
+static void run_clear( void ) {
+    clear_screen();
+}
+
+static void run_expand( void ) {
+    for (int y = 0; y < HEIGHT; y++)
+        expand_palette(screen+y*WIDTH*3,indices+y*WIDTH,WIDTH,graphics_palette);
+}
+
+static void run_blit( void ) {
+    blit_image(&image,0,0);
+}
+
+static void run_sprites( void ) { // A screen's worth of keyed sprite rows
+    for (int y = 0; y < HEIGHT; y++)
+        sprite_row(screen+y*WIDTH*3,sprite_data+y*WIDTH,WIDTH,0,1);
+}
+
+static void bench( const char* name, void (*fn)( void ), int frames ) {
+    fn(); // Warms up the caches
+    const double start = now_ns();
+    for (int i = 0; i < frames; i++)
+        fn();
+    const double elapsed = now_ns()-start;
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < sizeof(screen); i++)
+        hash = (hash^screen[i])*16777619u;
+    printf("%-8s %10.1f ns/frame ( screen %08x )\n",name,elapsed/frames,hash);
+}
+
+int main( int argc, char** argv ) {
+    const int frames = argc > 1 ? atoi(argv[1]) : 2000;
+    uint32_t state = 1;
+    for (int i = 0; i < WIDTH*HEIGHT; i++) {
+        state ^= state << 13; state ^= state >> 17; state ^= state << 5;
+        indices[i] = state;
+        image_data[i] = state>>8 | (state>>16&7 ? 1 : 0); // Mostly opaque, with some holes
+        sprite_data[i] = state>>16&7 ? state>>24 | 1 : 0; // Same, holes are zeros
+    }
+    bench("clear",run_clear,frames);
+    bench("expand",run_expand,frames);
+    bench("blit",run_blit,frames);
+    bench("sprites",run_sprites,frames);
+    return 0;
+}
@@ -0,0 +1,626 @@
+/*
+    Differential runner for EPU engines
+
+    Links two builds of the core ( symbols prefixed with `ref_` and `alt_`, see tasks/build-diff.sh ), runs the same
+    randomly generated programs on both in lockstep and compares their snapshots every few instructions.
+    On a mismatch both engines go back to the last matching snapshot and single-step to the first diverging instruction.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "../epu-c/ge.h"
+#include "../epu-c/snapshot.h"
+#include "../epu-c/replay.h"
+
+#define WIDTH  256
+#define HEIGHT 168
+
+#define PROGRAM_MAX_INSTRUCTIONS 256
+#define PROGRAM_MAX_SIZE         (PROGRAM_MAX_INSTRUCTIONS*64)
+#define BOOT_CODE                0xFF000000u
+
+/* Mirror of `epu_ctx` ( src/epu-c/epu.c ), checked against the context size reported by the snapshots */
+typedef struct diff_ctx_t {
+    uint8_t alive;
+    uint32_t c;
+    uint32_t s;
+    uint32_t r[8];
+    uint32_t u[8];
+    uint32_t pc;
+    uint32_t sp;
+    uint32_t cp;
+    uint32_t flags;
+    uint8_t cmp;
+    float f[4];
+    uint64_t wake;
+    uint32_t wait;
+    uint32_t events;
+} diff_ctx;
+
+//// Engines ////
+
+typedef struct engine_t {
+    const char* name;
+    int (*loop)( unsigned int steps );
+    int (*snapshot)( void* dest, int size, unsigned int base );
+    int (*restore)( const void* src, int size );
+    void (*replay_start)( unsigned int mode );
+    unsigned int (*clock_idle)( void );
+    uint64_t* steps;
+    uint32_t rng;
+} engine;
+
+#define ENGINE(prefix) \
+    extern int prefix##loop( unsigned int steps ); \
+    extern int prefix##epu_snapshot( void* dest, int size, unsigned int base ); \
+    extern int prefix##epu_restore( const void* src, int size ); \
+    extern void prefix##replay_start( unsigned int mode ); \
+    extern unsigned int prefix##clock_idle( void ); \
+    extern uint64_t prefix##epu_steps; \
+    static engine prefix##engine = { \
+        #prefix, prefix##loop, prefix##epu_snapshot, prefix##epu_restore, prefix##replay_start, prefix##clock_idle, &prefix##epu_steps, 0 \
+    }; \
+    void prefix##ge_screen_size( int width, int height ) { (void)width; (void)height; } \
+    void prefix##ge_screen_set( void* data, int x, int y, int width, int height ) { (void)data; (void)x; (void)y; (void)width; (void)height; } \
+    void prefix##ge_screen_push( void ) {} \
+    void prefix##ge_screen_get_size( int* width, int* height ) { *width = WIDTH; *height = HEIGHT; } \
+    int32_t prefix##ge_random( void ) { return next_random(&prefix##engine.rng); } \
+    void prefix##debug() {} \
+    int prefix##epu_call_peripheral( int address, int a, int b, int c, int d ) { (void)address; (void)a; (void)b; (void)c; (void)d; return 0; } \
+    int prefix##epu_load_floppy( int index, void* data, int* size ) { (void)index; (void)data; (void)size; return 0; } \
+    void* prefix##memset( void* dest, int c, size_t n ) { return memset(dest,c,n); } \
+    void* prefix##memcpy( void* dest, const void* src, size_t n ) { return memcpy(dest,src,n); } \
+    void* prefix##memmove( void* dest, const void* src, size_t n ) { return memmove(dest,src,n); }
+
+static int32_t next_random( uint32_t* state ) {
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+ENGINE(ref_)
+ENGINE(alt_)
+
+//// Program Generator ////
+
+typedef struct program_t {
+    uint8_t code[PROGRAM_MAX_SIZE];
+    uint32_t size;
+    uint32_t starts[PROGRAM_MAX_INSTRUCTIONS+1]; // Offset of each instruction
+    uint32_t count;
+    uint32_t fixups[PROGRAM_MAX_INSTRUCTIONS]; // Offsets of 4-byte absolute targets, holding an instruction index until patched
+    uint32_t fixup_count;
+} program;
+
+static uint32_t gen_state;
+
+static uint32_t rnd( uint32_t n ) {
+    return (uint32_t)next_random(&gen_state) % n;
+}
+
+static void emit8( program* prog, uint32_t v ) {
+    prog->code[prog->size++] = v;
+}
+
+static void emit( program* prog, uint32_t v, uint32_t size ) {
+    for (uint32_t i = 0; i < size; i++)
+        emit8(prog,v>>(i*8));
+}
+
+static void emit_target( program* prog ) {
+    prog->fixups[prog->fixup_count++] = prog->size;
+    emit(prog,rnd(0x10000),4); // Patched into an address once every instruction is laid out
+}
+
+/* Returns a memory address that is mostly accessible */
+static uint32_t random_address( uint32_t size ) {
+    const uint32_t offset = rnd(0x10000-size);
+    const uint32_t kind = rnd(64);
+    if (kind < 8)
+        return 0xD0000000u | rnd(4)<<16 | offset; // Specific RAM
+    if (kind < 16)
+        return 0x11000000u | offset; // Bound Data
+    if (kind < 24)
+        return BOOT_CODE | rnd(PROGRAM_MAX_SIZE); // Boot Code
+    if (kind < 28)
+        return 0x20000000u | rnd(4)<<16 | offset; // Video RAM
+    if (kind < 29)
+        return rnd(0xFFFFFFFFu); // Anything, which mostly faults
+    return offset; // Bound RAM
+}
+
+static uint32_t random_imd( uint32_t size ) {
+    const uint32_t v = next_random(&gen_state);
+    return rnd(4) ? v & (size >= 4 ? 0xFF : 0x0F) : v; // Mostly small values
+}
+
+static void emit_mov_imd( program* prog, uint8_t reg, uint32_t v ) {
+    emit8(prog,0x02); emit8(prog,0x02); emit8(prog,0x30); emit(prog,v,4); emit8(prog,reg);
+}
+
+static void patch( program* prog, uint32_t at, uint32_t v ) {
+    for (uint32_t i = 0; i < 4; i++)
+        prog->code[at+i] = v>>(i*8);
+}
+
+/* Relative weights of the kinds of instructions, out of 32 ( raw bytes mostly end the program, so they stay rare ) */
+static const uint32_t kind_weights[] = { 7, 7, 3, 3, 4, 2, 1, 2, 1, 1, 1 };
+
+static void gen_instruction( program* prog, int nested ) {
+    const uint32_t size = rnd(3);
+    const uint32_t tz = 1u<<size;
+    uint32_t kind = 0;
+    for (uint32_t n = rnd(32); n >= kind_weights[kind]; kind++)
+        n -= kind_weights[kind];
+    if (nested && kind == 7)
+        kind = 0;
+    switch (kind) {
+        case 0: { // ALU
+            uint8_t op = rnd(10);
+            const int imd = rnd(2);
+            const int sh = imd && rnd(2);
+            const uint32_t ssize = sh ? rnd(3) : size;
+            if (!imd && (op == 3 || op == 9))
+                op = 0; // Register divisors could be 0
+            emit8(prog,0x01);
+            emit8(prog,size | imd<<4 | sh<<5 | (sh ? ssize<<6 : 0));
+            emit8(prog,op);
+            emit8(prog,rnd(256));
+            if (imd) {
+                uint32_t v = random_imd(1u<<ssize);
+                if ((op == 3 || op == 9) && !(v & (0xFFFFFFFFu>>(32-8*(1u<<ssize))) & (0xFFFFFFFFu>>(32-8*tz))))
+                    v = 1;
+                emit(prog,v,1u<<ssize);
+            }
+        } break;
+        case 1: { // MOV
+            uint32_t i = rnd(4);
+            uint32_t o = rnd(3);
+            if ((i == 1 || i == 2) && (o == 1 || o == 2))
+                o = 0;
+            const int sh = i == 3 && rnd(2);
+            const uint32_t ssize = sh ? rnd(3) : size;
+            emit8(prog,0x02);
+            emit8(prog,size | sh<<5 | (sh ? ssize<<6 : 0));
+            emit8(prog,i<<4 | o);
+            if (i == 0 || i == 1)
+                emit8(prog,rnd(256));
+            if (i == 2)
+                emit(prog,random_address(tz),4);
+            if (i == 3)
+                emit(prog,random_imd(1u<<ssize),1u<<ssize);
+            if (o == 0 && (i == 2 || i == 3))
+                emit8(prog,rnd(16));
+            if (o == 1 && i != 0)
+                emit8(prog,rnd(16));
+            if (o == 2)
+                emit(prog,random_address(tz),4);
+        } break;
+        case 2: { // FPU
+            const uint32_t mode = rnd(3);
+            emit8(prog,0x03);
+            emit8(prog,mode | (mode == 2 ? rnd(4)<<3 : 0));
+            if (mode == 0)
+                emit8(prog,rnd(16)<<4 | rnd(4));
+            else if (mode == 1)
+                emit8(prog,rnd(4)<<4 | rnd(16));
+            else
+                emit8(prog,rnd(4)<<4 | rnd(4));
+        } break;
+        case 3: { // JMP
+            emit8(prog,0x04);
+            emit8(prog,2 | 16);
+            emit8(prog,0x03);
+            emit8(prog,rnd(2)<<4 | rnd(8));
+            emit_target(prog);
+        } break;
+        case 4: { // CMP
+            uint32_t a = rnd(4);
+            uint32_t b = rnd(4);
+            if ((a == 1 || a == 2) && (b == 1 || b == 2))
+                b = 0;
+            emit8(prog,0x05);
+            emit8(prog,size | rnd(2)<<4 | rnd(2)<<5);
+            emit8(prog,a<<4 | b);
+            if (a == 0 || a == 1)
+                emit8(prog,rnd(256));
+            if (a == 2)
+                emit(prog,random_address(tz),4);
+            if (a == 3)
+                emit(prog,random_imd(tz),tz);
+            if ((b == 0 || b == 1) && a >= 2)
+                emit8(prog,rnd(16));
+            if (b == 2)
+                emit(prog,random_address(tz),4);
+            if (b == 3)
+                emit(prog,random_imd(tz),tz);
+        } break;
+        case 5: { // INT, with sensible arguments most of the time
+            static const uint32_t interrupts[] = {
+                0x0100, 0x0101, 0x0102, 0x0103, 0x0200, 0x0201, 0x0202, 0x0300, 0x0301, 0x0400, 0x0401, 0xFF02, 0xFF03, 0xFF0F, 0xFF10, 0xFF11, 0xFF12,
+            };
+            const uint32_t interrupt = interrupts[rnd(sizeof(interrupts)/sizeof(interrupts[0]))];
+            if (rnd(4)) {
+                if (interrupt == 0x0300 || interrupt == 0x0301) {
+                    emit_mov_imd(prog,0,random_address(0x100));
+                    emit_mov_imd(prog,1,interrupt == 0x0300 ? random_address(0x100) : rnd(256));
+                    emit_mov_imd(prog,2,rnd(8) ? rnd(0x100) : 0xFFFFFFFFu-rnd(0x10000)); // Sizes that wrap around now and then
+                } else if (interrupt == 0x0102 || interrupt == 0x0103) {
+                    emit_mov_imd(prog,0,interrupt == 0x0103 ? 2 : rnd(100000));
+                    emit_mov_imd(prog,1,rnd(100000));
+                    emit_mov_imd(prog,2,0);
+                } else if (interrupt == 0xFF03) {
+                    emit_mov_imd(prog,0,rnd(256));
+                    emit_mov_imd(prog,1,rnd(0x1000000));
+                } else {
+                    emit_mov_imd(prog,0,rnd(8));
+                    emit_mov_imd(prog,1,rnd(8));
+                    emit_mov_imd(prog,2,rnd(8));
+                }
+            }
+            emit8(prog,0x06);
+            emit8(prog,0x00);
+            emit(prog,interrupt,4);
+        } break;
+        case 6: { // CAL
+            emit8(prog,0x07);
+            emit8(prog,2);
+            emit8(prog,0x03);
+            emit_target(prog);
+        } break;
+        case 7: { // Subroutine: CAL to an instruction followed by a RET, and a JMP over both
+            const uint32_t call = prog->size;
+            emit8(prog,0x07); emit8(prog,2); emit8(prog,0x03); emit(prog,0,4);
+            const uint32_t jump = prog->size;
+            emit8(prog,0x04); emit8(prog,2 | 16); emit8(prog,0x03); emit8(prog,0x10); emit(prog,0,4);
+            patch(prog,call+3,BOOT_CODE+prog->size);
+            gen_instruction(prog,1);
+            emit8(prog,0x08); emit8(prog,0x00);
+            patch(prog,jump+4,BOOT_CODE+prog->size);
+        } break;
+        case 8: { // ATOM, on an address loaded just before most of the time
+            const uint32_t op = rnd(4);
+            const uint32_t a = rnd(4);
+            if (rnd(4))
+                emit_mov_imd(prog,a,random_address(tz) & ~(tz-1));
+            emit8(prog,0x09);
+            emit8(prog,size);
+            emit8(prog,op);
+            emit8(prog,rnd(4)<<4 | a);
+        } break;
+        case 9: { // PUSH / POP, from a stack pointer set just before most of the time
+            if (rnd(4)) {
+                const uint32_t r = rnd(16);
+                emit_mov_imd(prog,r,random_address(64));
+                emit8(prog,0x0A); emit8(prog,0x10); emit8(prog,r); emit8(prog,0);
+            }
+            emit8(prog,0x0A+rnd(2));
+            emit8(prog,rnd(8) ? size : 0x10);
+            emit(prog,rnd(0x10000),2);
+        } break;
+        default: { // Anything
+            const uint32_t n = 2+rnd(8);
+            for (uint32_t i = 0; i < n; i++)
+                emit8(prog,rnd(256));
+        } break;
+    }
+}
+
+/* Generates a random program, made of mostly well formed instructions and looping back to its start */
+static void gen_program( program* prog, uint32_t seed ) {
+    memset(prog,0,sizeof(*prog));
+    gen_state = seed*2654435761u | 1;
+    const uint32_t count = 8+rnd(PROGRAM_MAX_INSTRUCTIONS-16);
+    for (prog->count = 0; prog->count < count; prog->count++) {
+        prog->starts[prog->count] = prog->size;
+        gen_instruction(prog,0);
+    }
+    prog->starts[prog->count] = prog->size;
+    emit8(prog,0x04); emit8(prog,2 | 16); emit8(prog,0x03); emit8(prog,0x10); // Jumps back to the start, always
+    emit(prog,BOOT_CODE,4);
+    for (uint32_t i = 0; i < prog->fixup_count; i++) {
+        uint32_t target;
+        memcpy(&target,prog->code+prog->fixups[i],4);
+        target = target%64 ? BOOT_CODE+prog->starts[target%(prog->count+1)] : random_address(4);
+        memcpy(prog->code+prog->fixups[i],&target,4);
+    }
+}
+
+//// Snapshots ////
+
+typedef struct checkpoint_t {
+    uint8_t* data;
+    int size;
+    uint32_t ref_rng;
+    uint32_t alt_rng;
+    uint64_t steps;
+} checkpoint;
+
+/* Rewrites the context records of a snapshot field by field, so that struct padding can't make them differ */
+static void canonicalize( uint8_t* data ) {
+    snapshot_header header;
+    memcpy(&header,data,sizeof(header));
+    uint8_t* rec = data+sizeof(header)+SNAPSHOT_VIDEO_SIZE(WIDTH,HEIGHT)+header.boot_size+4;
+    for (uint32_t i = 0; i < header.contexts; i++, rec += header.ctx_size) {
+        diff_ctx raw, ctx;
+        memcpy(&raw,rec,sizeof(raw));
+        memset(&ctx,0,sizeof(ctx));
+        ctx.alive = raw.alive;
+        ctx.c = raw.c;
+        ctx.s = raw.s;
+        memcpy(ctx.r,raw.r,sizeof(ctx.r));
+        memcpy(ctx.u,raw.u,sizeof(ctx.u));
+        ctx.pc = raw.pc;
+        ctx.sp = raw.sp;
+        ctx.cp = raw.cp;
+        ctx.flags = raw.flags;
+        ctx.cmp = raw.cmp;
+        memcpy(ctx.f,raw.f,sizeof(ctx.f));
+        ctx.wake = raw.wake;
+        ctx.wait = raw.wait;
+        ctx.events = raw.events;
+        memcpy(rec,&ctx,sizeof(ctx));
+    }
+}
+
+static uint8_t* take( engine* e, int* size ) {
+    *size = e->snapshot(0,0,0);
+    uint8_t* data = malloc(*size);
+    e->snapshot(data,*size,0);
+    canonicalize(data);
+    return data;
+}
+
+/* Builds the snapshot the runs start from: the program as the boot code and the kernel context at its start */
+static uint8_t* boot_snapshot( const program* prog, int* size ) {
+    int empty_size;
+    uint8_t* empty = take(&ref_engine,&empty_size); // Nothing ran yet, only the palette matters
+    snapshot_header header;
+    memcpy(&header,empty,sizeof(header));
+    if (header.ctx_size != 4+sizeof(diff_ctx)) {
+        fprintf(stderr,"epu_ctx changed ( %u bytes instead of %zu ), update diff_ctx\n",header.ctx_size-4,sizeof(diff_ctx));
+        exit(1);
+    }
+    const size_t fixed = sizeof(header)+SNAPSHOT_VIDEO_SIZE(WIDTH,HEIGHT);
+    header.boot_size = prog->size+8;
+    header.contexts = 1;
+    header.mappings = 0;
+    header.pages = 0;
+    header.size = fixed+header.boot_size+header.ctx_size;
+    *size = header.size;
+    uint8_t* data = calloc(1,header.size);
+    memcpy(data,&header,sizeof(header));
+    memcpy(data+sizeof(header),empty+sizeof(header),256*4);
+    memcpy(data+fixed,prog->code,prog->size+8);
+    const uint32_t id = 0;
+    const diff_ctx ctx = { .alive = 1, .pc = BOOT_CODE, .cp = 0x0000F000, .f = { 1.f, 2.f, 0.f, 0.f } };
+    memcpy(data+fixed+header.boot_size,&id,4);
+    memcpy(data+fixed+header.boot_size+4,&ctx,sizeof(ctx));
+    free(empty);
+    return data;
+}
+
+static const char* reg_names[] = {
+    "ra", "rb", "rc", "rd", "re", "rf", "rg", "rh", "ua", "ub", "uc", "ud", "ue", "uf", "ug", "uh",
+};
+
+static void report_contexts( const diff_ctx* a, const diff_ctx* b, uint32_t id ) {
+    #define FIELD(name,fmt,va,vb) if ((va) != (vb)) fprintf(stderr,"  context %u %s: " fmt " / " fmt "\n",id,name,va,vb);
+    FIELD("alive","%u",a->alive,b->alive)
+    FIELD("c","%u",a->c,b->c)
+    FIELD("s","%u",a->s,b->s)
+    for (int i = 0; i < 8; i++) {
+        FIELD(reg_names[i],"%08x",a->r[i],b->r[i])
+        FIELD(reg_names[i+8],"%08x",a->u[i],b->u[i])
+    }
+    FIELD("pc","%08x",a->pc,b->pc)
+    FIELD("sp","%08x",a->sp,b->sp)
+    FIELD("cp","%08x",a->cp,b->cp)
+    FIELD("flags","%08x",a->flags,b->flags)
+    FIELD("cmp","%02x",a->cmp,b->cmp)
+    for (int i = 0; i < 4; i++) {
+        uint32_t fa, fb;
+        memcpy(&fa,&a->f[i],4);
+        memcpy(&fb,&b->f[i],4);
+        FIELD("fpu","%08x",fa,fb)
+    }
+    FIELD("wake","%llu",(unsigned long long)a->wake,(unsigned long long)b->wake)
+    FIELD("wait","%x",a->wait,b->wait)
+    FIELD("events","%x",a->events,b->events)
+    #undef FIELD
+}
+
+/* Prints what differs between two snapshots */
+static void report( const uint8_t* a, const uint8_t* b ) {
+    snapshot_header ha, hb;
+    memcpy(&ha,a,sizeof(ha));
+    memcpy(&hb,b,sizeof(hb));
+    if (ha.cycles_lo != hb.cycles_lo || ha.cycles_hi != hb.cycles_hi)
+        fprintf(stderr,"  cycles: %u / %u\n",ha.cycles_lo,hb.cycles_lo);
+    if (ha.curr_context != hb.curr_context)
+        fprintf(stderr,"  current context: %u / %u\n",ha.curr_context,hb.curr_context);
+    if (ha.video_mode != hb.video_mode)
+        fprintf(stderr,"  video mode: %u / %u\n",ha.video_mode,hb.video_mode);
+    if (ha.contexts != hb.contexts || ha.mappings != hb.mappings || ha.pages != hb.pages) {
+        fprintf(stderr,"  contexts %u / %u, shared pages %u / %u, written pages %u / %u\n",ha.contexts,hb.contexts,ha.mappings,hb.mappings,ha.pages,hb.pages);
+        return;
+    }
+    const size_t fixed = sizeof(ha)+256*4;
+    if (memcmp(a+sizeof(ha),b+sizeof(hb),256*4))
+        fprintf(stderr,"  palette\n");
+    for (size_t i = 0; i < WIDTH*HEIGHT*3; i++) {
+        if (a[fixed+i] != b[fixed+i]) {
+            fprintf(stderr,"  screen at %zu,%zu\n",i/3%WIDTH,i/3/WIDTH);
+            break;
+        }
+    }
+    for (size_t i = 0; i < WIDTH*HEIGHT; i++) {
+        if (a[fixed+WIDTH*HEIGHT*3+i] != b[fixed+WIDTH*HEIGHT*3+i]) {
+            fprintf(stderr,"  screen indices at %zu,%zu\n",i%WIDTH,i/WIDTH);
+            break;
+        }
+    }
+    for (size_t i = 0; i < WIDTH/8*(HEIGHT/8)*4*2; i++) {
+        if (a[fixed+WIDTH*HEIGHT*4+i] != b[fixed+WIDTH*HEIGHT*4+i]) {
+            fprintf(stderr,"  text %s at %zu,%zu\n",i < WIDTH/8*(HEIGHT/8)*4 ? "cell" : "cell as drawn",i/4%(WIDTH/8),i/4/(WIDTH/8)%(HEIGHT/8));
+            break;
+        }
+    }
+    const uint8_t* ca = a+sizeof(ha)+SNAPSHOT_VIDEO_SIZE(WIDTH,HEIGHT)+ha.boot_size;
+    const uint8_t* cb = b+sizeof(hb)+SNAPSHOT_VIDEO_SIZE(WIDTH,HEIGHT)+hb.boot_size;
+    for (uint32_t i = 0; i < ha.contexts; i++, ca += ha.ctx_size, cb += hb.ctx_size) {
+        uint32_t ida, idb;
+        diff_ctx xa, xb;
+        memcpy(&ida,ca,4);
+        memcpy(&idb,cb,4);
+        memcpy(&xa,ca+4,sizeof(xa));
+        memcpy(&xb,cb+4,sizeof(xb));
+        if (ida != idb)
+            fprintf(stderr,"  context ids %u / %u\n",ida,idb);
+        else
+            report_contexts(&xa,&xb,ida);
+    }
+    if (memcmp(ca,cb,ha.mappings*sizeof(snapshot_mapping)))
+        fprintf(stderr,"  page tables\n");
+    const uint8_t* pa = ca+ha.mappings*sizeof(snapshot_mapping);
+    const uint8_t* pb = cb+hb.mappings*sizeof(snapshot_mapping);
+    for (uint32_t i = 0; i < ha.pages; i++, pa += sizeof(snapshot_page)+4096, pb += sizeof(snapshot_page)+4096) {
+        snapshot_page ga, gb;
+        memcpy(&ga,pa,sizeof(ga));
+        memcpy(&gb,pb,sizeof(gb));
+        if (memcmp(&ga,&gb,sizeof(ga))) {
+            fprintf(stderr,"  written pages differ: space %u seg %u page %u / space %u seg %u page %u\n",ga.space,ga.seg,ga.page,gb.space,gb.seg,gb.page);
+            return;
+        }
+        for (uint32_t j = 0; j < 4096; j++) {
+            if (pa[sizeof(ga)+j] != pb[sizeof(gb)+j]) {
+                fprintf(stderr,"  memory of space %u seg %u at %04x: %02x / %02x\n",ga.space,ga.seg,ga.page*4096+j,pa[sizeof(ga)+j],pb[sizeof(gb)+j]);
+                break;
+            }
+        }
+    }
+}
+
+/* Restores both engines to a checkpoint */
+static void rewind_to( const checkpoint* cp ) {
+    ref_engine.restore(cp->data,cp->size);
+    alt_engine.restore(cp->data,cp->size);
+    ref_engine.replay_start(REPLAY_OFF);
+    alt_engine.replay_start(REPLAY_OFF);
+    ref_engine.rng = cp->ref_rng;
+    alt_engine.rng = cp->alt_rng;
+}
+
+/* Runs both engines for some instructions, returns 1 if they diverged ( after reporting where ) */
+static int step_both( unsigned int n, int* status ) {
+    const int ra = ref_engine.loop(n);
+    const int rb = alt_engine.loop(n);
+    *status = ra;
+    return ra != rb || *ref_engine.steps != *alt_engine.steps;
+}
+
+/* Runs a program on both engines, returns 1 if they diverged */
+static int run( uint32_t seed, uint64_t max_steps, unsigned int period, int verbose ) {
+    static program prog;
+    gen_program(&prog,seed);
+
+    checkpoint cp = { 0 };
+    cp.data = boot_snapshot(&prog,&cp.size);
+    cp.ref_rng = cp.alt_rng = seed | 1;
+    rewind_to(&cp);
+
+    uint64_t done = 0;
+    while (done < max_steps) {
+        int status;
+        const int diverged_steps = step_both(period,&status);
+        int size_a, size_b;
+        uint8_t* a = take(&ref_engine,&size_a);
+        uint8_t* b = take(&alt_engine,&size_b);
+        const int diverged = diverged_steps || size_a != size_b || memcmp(a,b,size_a);
+        if (diverged) {
+            // Back to the last match, then one instruction at a time
+            rewind_to(&cp);
+            for (uint64_t i = 0;; i++) {
+                free(a); free(b);
+                const uint64_t at = cp.steps+*ref_engine.steps;
+                const int split = step_both(1,&status);
+                a = take(&ref_engine,&size_a);
+                b = take(&alt_engine,&size_b);
+                if (split || size_a != size_b || memcmp(a,b,size_a) || i > period) {
+                    fprintf(stderr,"seed %u: engines diverge at instruction %llu\n",seed,(unsigned long long)at);
+                    report(a,b);
+                    break;
+                }
+            }
+            free(a); free(b); free(cp.data);
+            return 1;
+        }
+        free(b);
+        free(cp.data);
+        cp.data = a;
+        cp.size = size_a;
+        cp.ref_rng = ref_engine.rng;
+        cp.alt_rng = alt_engine.rng;
+        cp.steps += *ref_engine.steps;
+        done = cp.steps;
+        rewind_to(&cp); // Both engines carry on from the same restored state, which also exercises restore
+        if (status || ref_engine.clock_idle() == 0xFFFFFFFF)
+            break; // The kernel stopped or waits on events nothing raises
+    }
+    if (verbose)
+        fprintf(stderr,"seed %u: %u instructions, %llu steps, ok\n",seed,prog.count,(unsigned long long)done);
+    free(cp.data);
+    return 0;
+}
+
+//// Main ////
+
+static void usage( const char* name ) {
+    fprintf(stderr,
+        "usage: %s [options]\n"
+        "  -s <seed>      first program seed ( default: 1 )\n"
+        "  -c <count>     amount of programs to run ( default: 1000 )\n"
+        "  -n <steps>     maximum instructions per program ( default: 100000 )\n"
+        "  -k <period>    instructions between two comparisons ( default: 1000 )\n"
+        "  -v             report every program\n",
+        name
+    );
+}
+
+int main( int argc, char** argv ) {
+    uint32_t seed = 1;
+    uint32_t count = 1000;
+    uint64_t steps = 100000;
+    unsigned int period = 1000;
+    int verbose = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i],"-s") && i+1 < argc)
+            seed = strtoul(argv[++i],0,0);
+        else if (!strcmp(argv[i],"-c") && i+1 < argc)
+            count = strtoul(argv[++i],0,0);
+        else if (!strcmp(argv[i],"-n") && i+1 < argc)
+            steps = strtoull(argv[++i],0,0);
+        else if (!strcmp(argv[i],"-k") && i+1 < argc)
+            period = strtoul(argv[++i],0,0);
+        else if (!strcmp(argv[i],"-v"))
+            verbose = 1;
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!period)
+        period = 1;
+
+    uint32_t failures = 0;
+    for (uint32_t i = 0; i < count; i++)
+        failures += run(seed+i,steps,period,verbose);
+
+    fprintf(stderr,"%u programs, %u diverged\n",count,failures);
+    return failures != 0;
+}
@@ -0,0 +1,143 @@
+/*
+    libFuzzer targets for the EPU core ( see tasks/build-fuzz.sh )
+
+    By default the input is the boot program of a freshly booted machine, which then runs for a bounded amount of
+    instructions. Built with FUZZ_DISK, the input is instead a disk image ( raw or compressed, see disk.h ) handed to the
+    FAT16 parser, the way `init` reads the boot file.
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../epu-c/snapshot.h"
+
+#define WIDTH  256
+#define HEIGHT 168
+
+#define BOOT_FLOPPY_SIZE 1048576
+#define FUZZ_MAX_PROGRAM 65536 // Larger programs don't reach anything new
+#define FUZZ_STEPS       100000
+
+//// Core Interface ////
+
+extern int init( void );
+extern int loop( unsigned int steps );
+extern int epu_snapshot( void* dest, int size, unsigned int base );
+extern int epu_restore( const void* src, int size );
+
+/* Mirror of `fat_disk` ( src/epu-c/fat16.h ), whose `size_t` is the core's 32-bit one ( src/epu-c/inttypes.h ) */
+typedef struct fat_disk_t {
+    uint8_t* data;
+    void* boot;
+    uint32_t size;
+    int (*load)( struct fat_disk_t* disk, uint32_t addr, uint32_t size );
+} __attribute__((packed)) fat_disk;
+
+extern int disk_mount( fat_disk* disk, uint8_t* image, uint32_t size );
+extern int fat_read_boot_sector( fat_disk* disk );
+extern int fat_boot_file( fat_disk* disk, void* data, int* size, uint32_t capacity );
+
+//// Host Calls ////
+
+static uint8_t* floppy;
+
+void ge_screen_size( int width, int height ) { (void)width; (void)height; }
+void ge_screen_set( void* data, int x, int y, int width, int height ) { (void)data; (void)x; (void)y; (void)width; (void)height; }
+void ge_screen_push( void ) {}
+int32_t ge_random( void ) { return 4; }
+int epu_call_peripheral( int address, int a, int b, int c, int d ) { (void)address; (void)a; (void)b; (void)c; (void)d; return 0; }
+
+int epu_load_floppy( int index, void* data, int* size ) {
+    if (index != 0 || !floppy)
+        return 0;
+    if (data)
+        memcpy(data,floppy,BOOT_FLOPPY_SIZE);
+    if (size)
+        *size = BOOT_FLOPPY_SIZE;
+    return 1;
+}
+
+//// Instruction Stream ////
+
+static void put16( uint8_t* p, uint16_t v ) { p[0] = v; p[1] = v>>8; }
+static void put32( uint8_t* p, uint32_t v ) { put16(p,v); put16(p+2,v>>16); }
+
+/* Builds the smallest disk `init` accepts: one FAT, one root directory sector and a 1 byte BOOT file ( a HLT ) */
+static uint8_t* make_floppy( void ) {
+    uint8_t* d = calloc(1,BOOT_FLOPPY_SIZE);
+    put16(d+0x0B,512); // Sector size
+    d[0x0D] = 1;       // Sectors per cluster
+    put16(d+0x0E,1);   // Reserved sectors
+    d[0x10] = 1;       // FAT copies
+    put16(d+0x11,16);  // Root entries
+    put16(d+0x16,1);   // Sectors per FAT
+    put16(d+0x1FE,0xAA55);
+    put16(d+512+2*2,0xFFFF); // Cluster 2 ends its chain
+    memcpy(d+1024,"BOOT       ",11);
+    put16(d+1024+0x1A,2);
+    put32(d+1024+0x1C,1);
+    return d;
+}
+
+static uint8_t* base;      // Snapshot of the booted machine
+static int base_size;
+static uint8_t* state;     // Base snapshot with the input as its boot program
+static size_t state_head;  // Header, palette and framebuffers
+static size_t state_tail;  // Contexts, mappings and pages
+
+static void boot( void ) {
+    floppy = make_floppy();
+    if (init())
+        abort();
+    base_size = epu_snapshot(0,0,0);
+    base = malloc(base_size);
+    epu_snapshot(base,base_size,0);
+    snapshot_header header;
+    memcpy(&header,base,sizeof(header));
+    state_head = sizeof(header)+SNAPSHOT_VIDEO_SIZE(WIDTH,HEIGHT);
+    state_tail = base_size-state_head-header.boot_size;
+    state = malloc(state_head+FUZZ_MAX_PROGRAM+state_tail);
+    memcpy(state,base,state_head);
+}
+
+static int fuzz_code( const uint8_t* data, size_t size ) {
+    if (!base)
+        boot();
+    if (size > FUZZ_MAX_PROGRAM)
+        return -1;
+    snapshot_header header;
+    memcpy(&header,base,sizeof(header));
+    memcpy(state+state_head,data,size);
+    memcpy(state+state_head+size,base+base_size-state_tail,state_tail);
+    header.boot_size = size;
+    header.size = state_head+size+state_tail;
+    memcpy(state,&header,sizeof(header));
+    if (epu_restore(state,header.size))
+        abort();
+    loop(FUZZ_STEPS);
+    return 0;
+}
+
+//// Disk Images ////
+
+static uint8_t program[16777216];
+
+static int fuzz_disk( const uint8_t* data, size_t size ) {
+    uint8_t sector[512];
+    fat_disk disk = { .boot = sector };
+    int program_size;
+    if (size > BOOT_FLOPPY_SIZE || disk_mount(&disk,(uint8_t*)data,size) || fat_read_boot_sector(&disk))
+        return 0;
+    fat_boot_file(&disk,program,&program_size,sizeof(program));
+    return 0;
+}
+
+int LLVMFuzzerTestOneInput( const uint8_t* data, size_t size ) {
+#ifdef FUZZ_DISK
+    return fuzz_disk(data,size);
+#else
+    return fuzz_code(data,size);
+#endif
+}
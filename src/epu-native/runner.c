@@ -0,0 +1,619 @@
+/*
+    Headless native host for the EPU core
+
+    Provides the host calls the browser normally implements ( see index.js ),
+    loads a disk image from a file and runs the core without any pacing.
+    With `-j`, the contexts are spread over several cores, each running on its own thread.
+*/
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "../epu-c/profile.h"
+#include "../epu-c/replay.h"
+#include "../epu-c/bus.h"
+#include "../epu-c/stream.h"
+
+#define WIDTH  256
+#define HEIGHT 168
+
+#define BOOT_FLOPPY_SIZE 1048576
+#define TRACE_BUFFER_SIZE 1048576
+#define MAX_CORES 8
+#define CORE_QUANTUM 16384 // Instructions each core runs between two merges of their clocks
+
+//// Core Interface ////
+
+extern int init( void );
+extern int loop( unsigned int steps );
+extern int profile_snapshot( void* dest, int size );
+extern unsigned int clock_idle( void );
+extern void epu_event( unsigned int events );
+extern int epu_snapshot( void* dest, int size, unsigned int base );
+extern int epu_restore( const void* src, int size );
+extern void replay_buffer( unsigned char* log, unsigned int size );
+extern void replay_start( unsigned int mode );
+extern unsigned int replay_state( void );
+extern unsigned int replay_length( void );
+extern int replay_loop( unsigned int steps );
+extern int epu_set_cores( unsigned int n );
+extern int loop_core( unsigned int core, unsigned int steps );
+extern void cores_sync( void );
+extern bus_batch* bus_batch_ptr( void );
+extern void bus_complete( uint32_t tag, int32_t result );
+
+#define EVENT_BITS_VIDEO 4
+
+//// Host State ////
+
+static unsigned char floppy[BOOT_FLOPPY_SIZE];
+static int floppy_size;
+
+static int screen_w = WIDTH;
+static int screen_h = HEIGHT;
+static unsigned char frame[WIDTH*HEIGHT*3];
+static unsigned char frame_dirty[HEIGHT]; // Rows set since the last frame was streamed
+static unsigned long frames;
+
+static uint32_t bus_pending[BUS_RING_SIZE]; // Tags of the timer commands, completed after the current slice of instructions
+static unsigned int bus_pending_count;
+
+static double now_us( void ) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC,&t);
+    return t.tv_sec*1e6+t.tv_nsec/1e3;
+}
+
+//// Video Stream ////
+
+#define TILES_X ((WIDTH+STREAM_TILE-1)/STREAM_TILE)
+#define TILES_Y ((HEIGHT+STREAM_TILE-1)/STREAM_TILE)
+#define TILE_PIXELS (STREAM_TILE*STREAM_TILE)
+
+static FILE* stream;
+static unsigned char stream_sent[WIDTH*HEIGHT*3]; // The frame as the decoder sees it
+static unsigned char stream_buffer[TILES_X*TILES_Y*(sizeof(stream_tile)+TILE_PIXELS*3)+TILE_PIXELS*2]; // And the runs of the last tile
+static unsigned long stream_frames;   // Frames written, the others didn't change
+static unsigned long stream_tiles;
+static unsigned long long stream_bytes;
+static unsigned long stream_max_bytes;
+static double stream_time;            // Spent encoding, in microseconds
+static double stream_max_time;
+
+/* Writes the header of the stream, every tile will be sent with the first frame */
+static int stream_open( const char* path ) {
+    stream = fopen(path,"wb");
+    if (!stream)
+        return 1;
+    const stream_header header = { STREAM_MAGIC, STREAM_VERSION, WIDTH, HEIGHT, STREAM_TILE, 0 };
+    fwrite(&header,1,sizeof(header),stream);
+    memset(frame_dirty,1,sizeof(frame_dirty));
+    return 0;
+}
+
+/* Encodes a tile as a palette and runs of its indices, or as is when that wouldn't be smaller, returns its size */
+static int stream_tile_encode( unsigned char* out, int index, int tx, int ty ) {
+    const int w = WIDTH-tx < STREAM_TILE ? WIDTH-tx : STREAM_TILE;
+    const int h = HEIGHT-ty < STREAM_TILE ? HEIGHT-ty : STREAM_TILE;
+    const int raw = w*h*3;
+    uint32_t palette[TILE_PIXELS];
+    unsigned char* runs = out+sizeof(stream_tile)+TILE_PIXELS*3; // Past the largest palette, moved down once it is known
+    int colors = 0;
+    int last = -1;
+    int size = 0;
+    for (int y = ty; y < ty+h; y++) {
+        for (int x = tx; x < tx+w; x++) {
+            const unsigned char* p = frame+(x+y*WIDTH)*3;
+            const uint32_t color = p[0] | p[1] << 8 | p[2] << 16;
+            int c = last >= 0 && palette[last] == color ? last : 0;
+            while (c < colors && palette[c] != color)
+                c++;
+            if (c == colors)
+                palette[colors++] = color;
+            if (c == last && runs[size-2] < 255)
+                runs[size-2]++;
+            else {
+                runs[size++] = 0;
+                runs[size++] = c;
+            }
+            last = c;
+        }
+    }
+    stream_tile* tile = (stream_tile*)out;
+    tile->index = index;
+    if (colors*3+size < raw) {
+        tile->mode = STREAM_TILE_RLE;
+        tile->colors = colors-1;
+        unsigned char* p = out+sizeof(stream_tile);
+        for (int c = 0; c < colors; c++, p += 3) {
+            p[0] = palette[c];
+            p[1] = palette[c] >> 8;
+            p[2] = palette[c] >> 16;
+        }
+        memmove(p,runs,size);
+        return sizeof(stream_tile)+colors*3+size;
+    }
+    tile->mode = STREAM_TILE_RAW;
+    tile->colors = 0;
+    for (int y = ty; y < ty+h; y++)
+        memcpy(out+sizeof(stream_tile)+(y-ty)*w*3,frame+(tx+y*WIDTH)*3,w*3);
+    return sizeof(stream_tile)+raw;
+}
+
+/* Writes the tiles that changed since the last frame that was streamed */
+static void stream_push( void ) {
+    const double t0 = now_us();
+    int size = 0;
+    int tiles = 0;
+    for (int ty = 0; ty < HEIGHT; ty += STREAM_TILE) {
+        const int h = HEIGHT-ty < STREAM_TILE ? HEIGHT-ty : STREAM_TILE;
+        int dirty = 0;
+        for (int y = ty; y < ty+h; y++)
+            dirty |= frame_dirty[y];
+        if (!dirty)
+            continue;
+        for (int tx = 0; tx < WIDTH; tx += STREAM_TILE) {
+            const int w = WIDTH-tx < STREAM_TILE ? WIDTH-tx : STREAM_TILE;
+            int changed = stream_frames == 0;
+            for (int y = ty; y < ty+h && !changed; y++)
+                changed = memcmp(frame+(tx+y*WIDTH)*3,stream_sent+(tx+y*WIDTH)*3,w*3);
+            if (!changed)
+                continue;
+            size += stream_tile_encode(stream_buffer+size,tx/STREAM_TILE+ty/STREAM_TILE*TILES_X,tx,ty);
+            tiles++;
+            for (int y = ty; y < ty+h; y++)
+                memcpy(stream_sent+(tx+y*WIDTH)*3,frame+(tx+y*WIDTH)*3,w*3);
+        }
+        for (int y = ty; y < ty+h; y++)
+            frame_dirty[y] = 0;
+    }
+    if (tiles) {
+        const stream_frame header = { size, frames, tiles, 0 };
+        fwrite(&header,1,sizeof(header),stream);
+        fwrite(stream_buffer,1,size,stream);
+        fflush(stream); // Whatever reads a pipe gets the frame right away
+        const unsigned long bytes = sizeof(header)+size;
+        stream_frames++;
+        stream_tiles += tiles;
+        stream_bytes += bytes;
+        if (bytes > stream_max_bytes)
+            stream_max_bytes = bytes;
+    }
+    const double t = now_us()-t0;
+    stream_time += t;
+    if (t > stream_max_time)
+        stream_max_time = t;
+}
+
+static void print_stream( void ) {
+    fprintf(stderr,"stream: %lu of %lu frames changed, %lu tiles, %llu bytes\n",stream_frames,frames,stream_tiles,stream_bytes+sizeof(stream_header));
+    if (stream_frames)
+        fprintf(stderr,"  per changed frame: %.1f tiles, %.0f bytes ( at most %lu )\n",(double)stream_tiles/stream_frames,(double)stream_bytes/stream_frames,stream_max_bytes);
+    if (frames)
+        fprintf(stderr,"  per frame: %.1fus encoding ( at most %.1fus )\n",stream_time/frames,stream_max_time);
+}
+
+//// Host Calls ////
+
+void ge_screen_size( int width, int height ) {
+    screen_w = width;
+    screen_h = height;
+}
+
+void ge_screen_set( void* data, int x, int y, int width, int height ) {
+    for (int yy = 0; yy < height && yy+y < screen_h && yy+y < HEIGHT; yy++) {
+        for (int xx = 0; xx < width && xx+x < screen_w && xx+x < WIDTH; xx++) {
+            const int i = ((x+xx)+(y+yy)*screen_w)*3;
+            memcpy(frame+i,(unsigned char*)data+i,3);
+        }
+        frame_dirty[yy+y] = 1;
+    }
+}
+
+void ge_screen_push( void ) {
+    frames++;
+    if (stream)
+        stream_push();
+    epu_event(EVENT_BITS_VIDEO); // Frames are "presented" right away
+}
+
+void ge_screen_get_size( int* width, int* height ) {
+    *width = screen_w;
+    *height = screen_h;
+}
+
+int32_t ge_random( void ) {
+    return rand();
+}
+
+void debug() {}
+
+/* Runs a batch of peripheral bus commands: the console prints `a`, the timer completes once the current slice of instructions is over */
+int epu_call_peripheral( int address, int a, int b, int c, int d ) {
+    (void)b; (void)c; (void)d;
+    if ((uint32_t)address != BUS_BATCH)
+        return 0;
+    bus_batch* batch = bus_batch_ptr();
+    for (int i = 0; i < a && i < BUS_RING_SIZE; i++) {
+        const bus_command* cmd = &batch->commands[i];
+        if (cmd->address == BUS_DEVICE_CONSOLE) {
+            fputc(cmd->a,stdout);
+            batch->results[i] = 0;
+        }
+        else if (cmd->address == BUS_DEVICE_TIMER && bus_pending_count < BUS_RING_SIZE) {
+            bus_pending[bus_pending_count++] = cmd->tag;
+            batch->results[i] = BUS_PENDING;
+        }
+        else
+            batch->results[i] = -1;
+    }
+    return 0;
+}
+
+/* Completes the timer commands, there is no pacing so they are all due */
+static void bus_flush( void ) {
+    for (unsigned int i = 0; i < bus_pending_count; i++)
+        bus_complete(bus_pending[i],0);
+    bus_pending_count = 0;
+}
+
+int epu_load_floppy( int index, void* data, int* size ) {
+    if (index != 0 || !floppy_size)
+        return 0;
+    if (data)
+        memcpy(data,floppy,floppy_size);
+    if (size)
+        *size = floppy_size;
+    return 1;
+}
+
+//// Cores ////
+
+static unsigned int cores = 1;
+static pthread_barrier_t quantum_start;
+static pthread_barrier_t quantum_end;
+static unsigned int quantum_steps; // 0 stops the threads
+static int core_status[MAX_CORES];
+
+static void* core_thread( void* arg ) {
+    const unsigned int core = (unsigned int)(uintptr_t)arg;
+    for (;;) {
+        pthread_barrier_wait(&quantum_start);
+        if (!quantum_steps)
+            return 0;
+        core_status[core] = loop_core(core,quantum_steps);
+        pthread_barrier_wait(&quantum_end);
+    }
+}
+
+/* Starts the threads of cores 1 and up, core 0 runs on the main thread */
+static int start_cores( void ) {
+    pthread_barrier_init(&quantum_start,0,cores);
+    pthread_barrier_init(&quantum_end,0,cores);
+    for (unsigned int i = 1; i < cores; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread,0,core_thread,(void*)(uintptr_t)i))
+            return 1;
+        pthread_detach(thread);
+    }
+    return 0;
+}
+
+static void stop_cores( void ) {
+    quantum_steps = 0;
+    pthread_barrier_wait(&quantum_start);
+}
+
+/* Runs a quantum of every core, returns the status of the first one that stopped ( the kernel's first ) */
+static int run_cores( unsigned int steps ) {
+    quantum_steps = steps;
+    pthread_barrier_wait(&quantum_start);
+    core_status[0] = loop_core(0,steps);
+    pthread_barrier_wait(&quantum_end);
+    cores_sync();
+    for (unsigned int i = 0; i < cores; i++) {
+        if (core_status[i])
+            return core_status[i];
+    }
+    return 0;
+}
+
+//// Output ////
+
+static const char* opcode_names[256] = {
+    "hlt", "alu", "mov", "fpu", "jmp", "cmp", "int", "cal", "ret", "atom", "push", "pop",
+};
+
+/* Writes the sampled program counters as folded stacks ( flamegraph.pl / speedscope / inferno ) */
+static int write_profile( const char* path, const profile* prof ) {
+    FILE* f = fopen(path,"w");
+    if (!f)
+        return 1;
+    for (int s = 0; s < 256; s++) {
+        for (int b = 0; b < PROFILE_PC_BUCKETS; b++) {
+            if (prof->pcs[s][b])
+                fprintf(f,"space %d;0x%04x %u\n",s,b<<PROFILE_PC_SHIFT,prof->pcs[s][b]);
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+static void print_profile( const profile* prof ) {
+    fprintf(stderr,"instructions: %u\n",prof->instructions);
+    fprintf(stderr,"dispatches: %u ( %u instructions fused )\n",prof->instructions-prof->fused,prof->fused);
+    fprintf(stderr,"opcodes:\n");
+    for (int op = 0; op < 256; op++) {
+        for (int flag = 0; flag < 256; flag++) {
+            if (prof->ops[op][flag])
+                fprintf(stderr,"  %-4s %02x : %u\n",opcode_names[op] ? opcode_names[op] : "???",flag,prof->ops[op][flag]);
+        }
+    }
+    fprintf(stderr,"interrupts:\n");
+    for (int r = 0; r < 256; r++) {
+        for (int c = 0; c < 256; c++) {
+            if (prof->ints[r][c])
+                fprintf(stderr,"  %02x%02x : %u\n",r,c,prof->ints[r][c]);
+        }
+    }
+    fprintf(stderr,"context switches:\n");
+    for (int c = 0; c < 256; c++) {
+        if (prof->switches[c])
+            fprintf(stderr,"  %3d : %u\n",c,prof->switches[c]);
+    }
+}
+
+/* Reads a whole file into a new buffer */
+static unsigned char* read_file( const char* path, long* size ) {
+    FILE* f = fopen(path,"rb");
+    if (!f)
+        return 0;
+    fseek(f,0,SEEK_END);
+    *size = ftell(f);
+    fseek(f,0,SEEK_SET);
+    unsigned char* data = malloc(*size ? *size : 1);
+    if (fread(data,1,*size,f) != (size_t)*size) {
+        free(data);
+        data = 0;
+    }
+    fclose(f);
+    return data;
+}
+
+/* Writes a full snapshot of the machine, prefixed by its size when it starts a trace */
+static int write_snapshot( FILE* f, int prefixed ) {
+    const int size = epu_snapshot(0,0,0);
+    void* data = malloc(size);
+    epu_snapshot(data,size,0);
+    if (prefixed) {
+        const uint32_t n = size;
+        fwrite(&n,1,4,f);
+    }
+    const int ok = fwrite(data,1,size,f) == (size_t)size;
+    free(data);
+    return !ok;
+}
+
+static int restore_snapshot( const void* data, long size, const char* path ) {
+    const double t0 = now_us();
+    const int status = epu_restore(data,size);
+    if (!status)
+        fprintf(stderr,"restored `%s` in %.1fus\n",path,now_us()-t0);
+    return status;
+}
+
+static int write_frame( const char* path ) {
+    FILE* f = fopen(path,"wb");
+    if (!f)
+        return 1;
+    fprintf(f,"P6\n%d %d\n255\n",WIDTH,HEIGHT);
+    fwrite(frame,1,sizeof(frame),f);
+    fclose(f);
+    return 0;
+}
+
+//// Main ////
+
+static void usage( const char* name ) {
+    fprintf(stderr,
+        "usage: %s [options] <boot.img>\n"
+        "  -n <steps>    amount of instructions to run ( default: until the kernel stops, per core with -j )\n"
+        "  -j <cores>    spread the contexts over 1, 2, 4 or 8 cores, each on its own thread\n"
+        "  -p <file>     write the sampled program counters as folded stacks ( EPU_PROFILE builds )\n"
+        "  -o <file>     write the last presented frame as a PPM image\n"
+        "  -v <file>     stream the tiles that changed in every presented frame ( a file or a pipe )\n"
+        "  -S <file>     write a snapshot of the machine once done\n"
+        "  -R <file>     start from a snapshot instead of booting ( no boot image needed )\n"
+        "  -T <file>     record a trace ( a snapshot followed by the log of every host call result )\n"
+        "  -P <file>     replay a trace instead of booting, until its log runs out\n",
+        name
+    );
+}
+
+int main( int argc, char** argv ) {
+    unsigned long long steps = 0;
+    const char* profile_path = 0;
+    const char* frame_path = 0;
+    const char* stream_path = 0;
+    const char* image_path = 0;
+    const char* save_path = 0;
+    const char* restore_path = 0;
+    const char* trace_path = 0;
+    const char* replay_path = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i],"-n") && i+1 < argc)
+            steps = strtoull(argv[++i],0,0);
+        else if (!strcmp(argv[i],"-j") && i+1 < argc)
+            cores = strtoul(argv[++i],0,0);
+        else if (!strcmp(argv[i],"-p") && i+1 < argc)
+            profile_path = argv[++i];
+        else if (!strcmp(argv[i],"-o") && i+1 < argc)
+            frame_path = argv[++i];
+        else if (!strcmp(argv[i],"-v") && i+1 < argc)
+            stream_path = argv[++i];
+        else if (!strcmp(argv[i],"-S") && i+1 < argc)
+            save_path = argv[++i];
+        else if (!strcmp(argv[i],"-R") && i+1 < argc)
+            restore_path = argv[++i];
+        else if (!strcmp(argv[i],"-T") && i+1 < argc)
+            trace_path = argv[++i];
+        else if (!strcmp(argv[i],"-P") && i+1 < argc)
+            replay_path = argv[++i];
+        else if (argv[i][0] != '-' && !image_path)
+            image_path = argv[i];
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!!image_path + !!restore_path + !!replay_path != 1 || (trace_path && replay_path) || (cores != 1 && (trace_path || replay_path))) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (stream_path && stream_open(stream_path)) {
+        fprintf(stderr,"could not write `%s`\n",stream_path);
+        return 1;
+    }
+
+    int status = 0;
+    unsigned char* replay = 0;
+    if (restore_path || replay_path) {
+        const char* path = restore_path ? restore_path : replay_path;
+        long size;
+        unsigned char* data = read_file(path,&size);
+        if (!data) {
+            fprintf(stderr,"could not open `%s`\n",path);
+            return 1;
+        }
+        uint32_t snapshot_size = size;
+        if (replay_path) {
+            if (size >= 4)
+                memcpy(&snapshot_size,data,4);
+            if (size < 4 || snapshot_size > size-4) {
+                fprintf(stderr,"`%s` is not a trace\n",path);
+                return 1;
+            }
+        }
+        status = restore_snapshot(data+(replay_path?4:0),snapshot_size,path);
+        if (status) {
+            fprintf(stderr,"could not restore `%s` ( status %d )\n",path,status);
+            return 1;
+        }
+        if (replay_path) {
+            replay = data;
+            replay_buffer(data+4+snapshot_size,size-4-snapshot_size);
+            replay_start(REPLAY_PLAY);
+        } else
+            free(data);
+    } else {
+        FILE* f = fopen(image_path,"rb");
+        if (!f) {
+            fprintf(stderr,"could not open `%s`\n",image_path);
+            return 1;
+        }
+        floppy_size = fread(floppy,1,sizeof(floppy),f);
+        fclose(f);
+
+        status = init();
+        if (status) {
+            fprintf(stderr,"`init` failed with status %d\n",status);
+            return 1;
+        }
+    }
+
+    if (cores != 1) {
+        if (epu_set_cores(cores)) {
+            fprintf(stderr,"the core can't run on %u cores ( it needs EPU_THREADS, without EPU_PROFILE )\n",cores);
+            return 1;
+        }
+        if (start_cores()) {
+            fprintf(stderr,"could not start the threads of the cores\n");
+            return 1;
+        }
+    }
+
+    FILE* trace = 0;
+    unsigned char* trace_buffer = 0;
+    if (trace_path) {
+        trace = fopen(trace_path,"wb");
+        if (!trace || write_snapshot(trace,1)) {
+            fprintf(stderr,"could not write `%s`\n",trace_path);
+            return 1;
+        }
+        trace_buffer = malloc(TRACE_BUFFER_SIZE);
+        replay_buffer(trace_buffer,TRACE_BUFFER_SIZE);
+        replay_start(REPLAY_RECORD);
+    }
+
+    const double t0 = now_us();
+    unsigned long long ran = 0;
+    while (!status && (!steps || ran < steps)) {
+        const unsigned int quantum = cores != 1 ? CORE_QUANTUM : 65536;
+        const unsigned int n = steps && steps-ran < quantum ? steps-ran : quantum;
+        status = replay ? replay_loop(n) : cores != 1 ? run_cores(n) : loop(n);
+        ran += n;
+        bus_flush();
+        if (trace) {
+            fwrite(trace_buffer,1,replay_length(),trace);
+            replay_buffer(trace_buffer,TRACE_BUFFER_SIZE);
+        }
+        if (replay && replay_state() != REPLAY_PLAY)
+            break; // The log ran out ( or no longer matches what the core does )
+        if (!status && clock_idle() == 0xFFFFFFFF)
+            break; // Nothing raises key events here, waiting on them would never end
+    }
+    const double elapsed = now_us()-t0;
+    if (cores != 1)
+        stop_cores();
+
+    fprintf(stderr,"execution %s with status %d after ~%llu instructions, %lu frames, in %.1fms\n",status?"finished":replay?"replayed":!steps||ran<steps?"blocked":"paused",status,ran,frames,elapsed/1e3);
+
+    if (trace) {
+        if (replay_state() == REPLAY_FULL)
+            fprintf(stderr,"the trace buffer overflowed, `%s` is incomplete\n",trace_path);
+        fclose(trace);
+        free(trace_buffer);
+    }
+    if (replay) {
+        const unsigned int state = replay_state();
+        fprintf(stderr,"replay %s\n",state == REPLAY_END ? "reached the end of the log" : state == REPLAY_DESYNC ? "diverged from the log" : "stopped before the end of the log");
+        free(replay);
+    }
+
+    const int profile_size = profile_snapshot(0,0);
+    if (profile_size) {
+        profile* prof = malloc(profile_size);
+        profile_snapshot(prof,profile_size);
+        print_profile(prof);
+        if (profile_path && write_profile(profile_path,prof))
+            fprintf(stderr,"could not write `%s`\n",profile_path);
+        free(prof);
+    } else if (profile_path) {
+        fprintf(stderr,"the core was built without EPU_PROFILE, no profile written\n");
+    }
+
+    if (stream) {
+        print_stream();
+        fclose(stream);
+    }
+
+    if (frame_path && write_frame(frame_path))
+        fprintf(stderr,"could not write `%s`\n",frame_path);
+
+    if (save_path) {
+        FILE* f = fopen(save_path,"wb");
+        if (!f || write_snapshot(f,0))
+            fprintf(stderr,"could not write `%s`\n",save_path);
+        if (f)
+            fclose(f);
+    }
+
+    return 0;
+}
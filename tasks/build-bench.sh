@@ -0,0 +1,17 @@
+#!/usr/bin/env sh
+
+## Builds the video kernel benchmark, with ( ./epu-bench ) and without ( ./epu-bench-scalar ) SIMD ##
+## ( x86 builds get -mssse3, CFLAGS can ask for more like -mavx2, and the SIMD build fails rather than coming out scalar ) ##
+set -xe
+
+CC=${CC:-cc}
+FLAGS="-Wall -Wextra -O2 -g $CFLAGS"
+case "$(uname -m)" in
+    x86_64|i?86) SIMD_FLAGS="-mssse3" ;;
+esac
+
+$CC $FLAGS $SIMD_FLAGS -DEPU_REQUIRE_SIMD -ffreestanding -fno-builtin -c -o ./epu-core.o ./src/epu-c/epu.c
+$CC $FLAGS -o ./epu-bench ./src/epu-native/bench.c ./epu-core.o
+$CC $FLAGS -DEPU_NO_SIMD -ffreestanding -fno-builtin -c -o ./epu-core.o ./src/epu-c/epu.c
+$CC $FLAGS -o ./epu-bench-scalar ./src/epu-native/bench.c ./epu-core.o
+rm ./epu-core.o
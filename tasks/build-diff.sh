@@ -0,0 +1,20 @@
+#!/usr/bin/env sh
+
+## Builds the differential runner, comparing two builds of the core ##
+## ( REF / ALT pick the sources, REF_FLAGS / ALT_FLAGS their flags, by default the same core at -O0 and -O2 ) ##
+set -xe
+
+CC=${CC:-cc}
+OBJCOPY=${OBJCOPY:-objcopy}
+FLAGS="-Wall -Wextra -g"
+REF=${REF:-./src/epu-c/epu.c}
+ALT=${ALT:-./src/epu-c/epu.c}
+REF_FLAGS=${REF_FLAGS:--O0}
+ALT_FLAGS=${ALT_FLAGS:--O2}
+
+$CC $FLAGS $REF_FLAGS -ffreestanding -fno-builtin -c -o ./epu-ref.o $REF
+$CC $FLAGS $ALT_FLAGS -ffreestanding -fno-builtin -c -o ./epu-alt.o $ALT
+$OBJCOPY --prefix-symbols=ref_ ./epu-ref.o
+$OBJCOPY --prefix-symbols=alt_ ./epu-alt.o
+$CC $FLAGS -O2 -o ./epu-diff ./src/epu-native/diff.c ./epu-ref.o ./epu-alt.o
+rm ./epu-ref.o ./epu-alt.o
@@ -0,0 +1,12 @@
+#!/usr/bin/env sh
+
+## Builds the libFuzzer targets ( needs clang ): ./epu-fuzz-code runs its inputs as boot programs, ./epu-fuzz-disk parses them as disk images ##
+set -xe
+
+CC=${CC:-clang}
+FLAGS="-Wall -Wextra -O1 -g -fsanitize=address,undefined -fno-sanitize-recover=undefined"
+
+$CC $FLAGS -fsanitize=fuzzer-no-link -ffreestanding -fno-builtin -c -o ./epu-core.o ./src/epu-c/epu.c
+$CC $FLAGS -fsanitize=fuzzer -o ./epu-fuzz-code ./src/epu-native/fuzz.c ./epu-core.o
+$CC $FLAGS -fsanitize=fuzzer -DFUZZ_DISK -o ./epu-fuzz-disk ./src/epu-native/fuzz.c ./epu-core.o
+rm ./epu-core.o
@@ -0,0 +1,15 @@
+#!/usr/bin/env sh
+
+## Builds the C part of the project as a native headless runner ##
+## ( PROFILE=1 enables the profiling counters, EPU_THREADS lets `-j` spread the contexts over several threads ) ##
+set -xe
+
+CC=${CC:-cc}
+FLAGS="-Wall -Wextra -O2 -g"
+if [ -n "$PROFILE" ]; then
+    FLAGS="$FLAGS -DEPU_PROFILE"
+fi
+
+$CC $FLAGS -DEPU_THREADS -ffreestanding -fno-builtin -c -o ./epu-core.o ./src/epu-c/epu.c
+$CC $FLAGS -pthread -o ./epu-native ./src/epu-native/runner.c ./epu-core.o
+rm ./epu-core.o
@@ -0,0 +1,79 @@
+#!/usr/bin/env python3
+
+## Converts a raw disk image into a compressed one ( see src/epu-c/disk.h ) ##
+## usage: tasks/packdisk.py [boot.img] [boot.epud] [chunk size] ##
+
+import struct, sys
+
+DISK_MAGIC   = 0x44555045
+DISK_VERSION = 1
+
+def lz4_block( data ):
+    '''Compresses data into a single LZ4 block ( greedy, with a table of the last position of each 4 byte sequence )'''
+    out = bytearray()
+    def length( n ):
+        while n >= 255:
+            out.append(255)
+            n -= 255
+        out.append(n)
+    def sequence( literals, offset=0, match=0 ):
+        out.append(min(len(literals),15)<<4 | (min(match-4,15) if match else 0))
+        if len(literals) >= 15:
+            length(len(literals)-15)
+        out.extend(literals)
+        if match:
+            out.extend(struct.pack('<H',offset))
+            if match-4 >= 15:
+                length(match-4-15)
+    n = len(data)
+    table = {}
+    anchor = 0
+    i = 0
+    while i < n-12: # The last match has to start 12 bytes before the end, and the last 5 bytes are literals
+        key = data[i:i+4]
+        candidate = table.get(key)
+        table[key] = i
+        if candidate is None or i-candidate > 65535:
+            i += 1
+            continue
+        match = 4
+        while match < n-5-i and data[candidate+match] == data[i+match]:
+            match += 1
+        sequence(data[anchor:i],i-candidate,match)
+        i += match
+        anchor = i
+    sequence(data[anchor:])
+    return bytes(out)
+
+def pack( raw, chunk_size ):
+    chunks = (len(raw)+chunk_size-1)//chunk_size
+    index = []
+    blobs = bytearray()
+    start = 20+chunks*8
+    for i in range(chunks):
+        chunk = raw[i*chunk_size:(i+1)*chunk_size]
+        if not any(chunk):
+            index.append((0,0))
+            continue
+        block = lz4_block(chunk)
+        if len(block) >= len(chunk):
+            block = chunk
+        index.append((start+len(blobs),len(block)))
+        blobs.extend(block)
+    header = struct.pack('<5I',DISK_MAGIC,DISK_VERSION,len(raw),chunk_size,chunks)
+    return header + b''.join(struct.pack('<2I',*e) for e in index) + bytes(blobs)
+
+if __name__ == '__main__':
+    src = sys.argv[1] if len(sys.argv) > 1 else 'boot.img'
+    dst = sys.argv[2] if len(sys.argv) > 2 else 'boot.epud'
+    chunk_size = int(sys.argv[3]) if len(sys.argv) > 3 else 4096
+    if chunk_size < 512 or chunk_size > 65536 or chunk_size & (chunk_size-1):
+        sys.exit('the chunk size has to be a power of two from 512 to 65536')
+    with open(src,'rb') as f:
+        raw = f.read()
+    packed = pack(raw,chunk_size)
+    if len(packed) >= len(raw):
+        sys.exit('`%s` doesn\'t get any smaller compressed'%src)
+    with open(dst,'wb') as f:
+        f.write(packed)
+    print('%s: %d -> %d bytes'%(dst,len(raw),len(packed)))